@@ -0,0 +1,298 @@
+#include <cstring>
+
+#include "blit.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLIT_NEON
+#endif
+
+// Copies rows bytes long, non_temporal is just a hint
+typedef void (*copy_rows_func)(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t row_bytes, int rows, bool non_temporal);
+
+struct blit_kernel {
+	const char *name;
+	copy_rows_func copy_rows;
+};
+
+static void copy_rows_generic(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t row_bytes, int rows, bool non_temporal) {
+	for (int i = 0; i < rows; i++) {
+		memcpy(dst, src, row_bytes);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+#ifdef BLIT_X86
+__attribute__((target("sse2")))
+static void copy_rows_sse2(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t row_bytes, int rows, bool non_temporal) {
+	for (int i = 0; i < rows; i++) {
+		size_t n = 0;
+		if (non_temporal) {
+			// Streaming stores need an aligned destination, pixels are at
+			// least 2 byte aligned so copy 2 bytes at a time until we get
+			// there
+			while (n + 2 <= row_bytes && (reinterpret_cast<uintptr_t>(dst + n) & 15) != 0) {
+				memcpy(dst + n, src + n, 2);
+				n += 2;
+			}
+			for (; n + 64 <= row_bytes; n += 64) {
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 16));
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 32));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 48));
+				_mm_stream_si128(reinterpret_cast<__m128i *>(dst + n), a);
+				_mm_stream_si128(reinterpret_cast<__m128i *>(dst + n + 16), b);
+				_mm_stream_si128(reinterpret_cast<__m128i *>(dst + n + 32), c);
+				_mm_stream_si128(reinterpret_cast<__m128i *>(dst + n + 48), d);
+			}
+		} else {
+			for (; n + 64 <= row_bytes; n += 64) {
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 16));
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 32));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n + 48));
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n), a);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n + 16), b);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n + 32), c);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n + 48), d);
+			}
+		}
+		for (; n + 16 <= row_bytes; n += 16) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + n), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n)));
+		}
+		if (n < row_bytes) {
+			memcpy(dst + n, src + n, row_bytes - n);
+		}
+		dst += dst_stride;
+		src += src_stride;
+	}
+	if (non_temporal) {
+		_mm_sfence();
+	}
+}
+
+__attribute__((target("avx2")))
+static void copy_rows_avx2(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t row_bytes, int rows, bool non_temporal) {
+	for (int i = 0; i < rows; i++) {
+		size_t n = 0;
+		if (non_temporal) {
+			while (n + 2 <= row_bytes && (reinterpret_cast<uintptr_t>(dst + n) & 31) != 0) {
+				memcpy(dst + n, src + n, 2);
+				n += 2;
+			}
+			for (; n + 128 <= row_bytes; n += 128) {
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 32));
+				__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 64));
+				__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 96));
+				_mm256_stream_si256(reinterpret_cast<__m256i *>(dst + n), a);
+				_mm256_stream_si256(reinterpret_cast<__m256i *>(dst + n + 32), b);
+				_mm256_stream_si256(reinterpret_cast<__m256i *>(dst + n + 64), c);
+				_mm256_stream_si256(reinterpret_cast<__m256i *>(dst + n + 96), d);
+			}
+		} else {
+			for (; n + 128 <= row_bytes; n += 128) {
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 32));
+				__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 64));
+				__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n + 96));
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n), a);
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n + 32), b);
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n + 64), c);
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n + 96), d);
+			}
+		}
+		for (; n + 32 <= row_bytes; n += 32) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + n), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n)));
+		}
+		if (n < row_bytes) {
+			memcpy(dst + n, src + n, row_bytes - n);
+		}
+		dst += dst_stride;
+		src += src_stride;
+	}
+	if (non_temporal) {
+		_mm_sfence();
+	}
+	// Avoid AVX-SSE transition penalties in the code that follows
+	_mm256_zeroupper();
+}
+#endif
+
+#ifdef BLIT_NEON
+// NEON has no non-temporal store intrinsics, so the hint is ignored
+static void copy_rows_neon(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, size_t row_bytes, int rows, bool non_temporal) {
+	for (int i = 0; i < rows; i++) {
+		size_t n = 0;
+		for (; n + 64 <= row_bytes; n += 64) {
+			uint8x16x4_t v = vld1q_u8_x4(src + n);
+			vst1q_u8_x4(dst + n, v);
+		}
+		for (; n + 16 <= row_bytes; n += 16) {
+			vst1q_u8(dst + n, vld1q_u8(src + n));
+		}
+		if (n < row_bytes) {
+			memcpy(dst + n, src + n, row_bytes - n);
+		}
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+#endif
+
+static blit_kernel select_kernel() {
+#ifdef BLIT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return { "avx2", copy_rows_avx2 };
+	}
+#ifdef __x86_64__
+	// SSE2 is part of x86-64
+	return { "sse2", copy_rows_sse2 };
+#else
+	if (__builtin_cpu_supports("sse2")) {
+		return { "sse2", copy_rows_sse2 };
+	}
+#endif
+#endif
+#ifdef BLIT_NEON
+	// NEON is mandatory on aarch64
+	return { "neon", copy_rows_neon };
+#endif
+	return { "generic", copy_rows_generic };
+}
+
+static const blit_kernel &kernel() {
+	static const blit_kernel selected = select_kernel();
+	return selected;
+}
+
+bool pixel_format_from_string(const char *name, enum pixel_format *format) {
+	if (strcmp(name, "a8r8g8b8") == 0) {
+		*format = PIXEL_FORMAT_XRGB8888;
+	} else if (strcmp(name, "r5g6b5") == 0) {
+		*format = PIXEL_FORMAT_RGB565;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+const char *pixel_format_name(enum pixel_format format) {
+	switch (format) {
+	case PIXEL_FORMAT_XRGB8888:
+		return "a8r8g8b8";
+	case PIXEL_FORMAT_RGB565:
+		return "r5g6b5";
+	}
+	return "unknown";
+}
+
+int pixel_format_bytes(enum pixel_format format) {
+	switch (format) {
+	case PIXEL_FORMAT_XRGB8888:
+		return 4;
+	case PIXEL_FORMAT_RGB565:
+		return 2;
+	}
+	return 4;
+}
+
+// What a conversion kernel needs to know about a pixel format, every format
+// converts through 32 bit xRGB
+template <enum pixel_format format>
+struct pixel_traits;
+
+template <>
+struct pixel_traits<PIXEL_FORMAT_XRGB8888> {
+	typedef uint32_t pixel;
+
+	static uint32_t to_xrgb8888(pixel p) {
+		return p;
+	}
+
+	static pixel from_xrgb8888(uint32_t p) {
+		return p;
+	}
+};
+
+template <>
+struct pixel_traits<PIXEL_FORMAT_RGB565> {
+	typedef uint16_t pixel;
+
+	static uint32_t to_xrgb8888(pixel p) {
+		uint32_t r = (p >> 11) & 0x1f;
+		uint32_t g = (p >> 5) & 0x3f;
+		uint32_t b = p & 0x1f;
+		// Repeat the top bits in the low ones, so white stays white
+		r = (r << 3) | (r >> 2);
+		g = (g << 2) | (g >> 4);
+		b = (b << 3) | (b >> 2);
+		return (r << 16) | (g << 8) | b;
+	}
+
+	static pixel from_xrgb8888(uint32_t p) {
+		return static_cast<pixel>(((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f));
+	}
+};
+
+template <enum pixel_format dst_format, enum pixel_format src_format>
+static void blit_rect_formats(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, int x, int y, int cx, int cy, bool non_temporal) {
+	typedef pixel_traits<dst_format> dst_traits;
+	typedef pixel_traits<src_format> src_traits;
+	typedef typename dst_traits::pixel dst_pixel;
+	typedef typename src_traits::pixel src_pixel;
+
+	if (cx <= 0 || cy <= 0) {
+		return;
+	}
+	dst += static_cast<size_t>(y) * dst_stride + static_cast<size_t>(x) * sizeof(dst_pixel);
+	src += static_cast<size_t>(y) * src_stride + static_cast<size_t>(x) * sizeof(src_pixel);
+
+	if constexpr (dst_format == src_format) {
+		size_t row_bytes = static_cast<size_t>(cx) * sizeof(src_pixel);
+		kernel().copy_rows(dst, dst_stride, src, src_stride, row_bytes, cy, non_temporal);
+	} else {
+		// The buffers are only aligned to their pixel size, and this loop
+		// is simple enough for the compiler to vectorize
+		for (int i = 0; i < cy; i++) {
+			for (int n = 0; n < cx; n++) {
+				src_pixel in;
+				memcpy(&in, src + n * sizeof(src_pixel), sizeof(src_pixel));
+				dst_pixel out = dst_traits::from_xrgb8888(src_traits::to_xrgb8888(in));
+				memcpy(dst + n * sizeof(dst_pixel), &out, sizeof(dst_pixel));
+			}
+			dst += dst_stride;
+			src += src_stride;
+		}
+	}
+}
+
+template <enum pixel_format src_format>
+static blit_rect_func blit_rect_func_from(enum pixel_format dst_format) {
+	switch (dst_format) {
+	case PIXEL_FORMAT_XRGB8888:
+		return blit_rect_formats<PIXEL_FORMAT_XRGB8888, src_format>;
+	case PIXEL_FORMAT_RGB565:
+		return blit_rect_formats<PIXEL_FORMAT_RGB565, src_format>;
+	}
+	return nullptr;
+}
+
+blit_rect_func blit_rect_func_for(enum pixel_format dst_format, enum pixel_format src_format) {
+	switch (src_format) {
+	case PIXEL_FORMAT_XRGB8888:
+		return blit_rect_func_from<PIXEL_FORMAT_XRGB8888>(dst_format);
+	case PIXEL_FORMAT_RGB565:
+		return blit_rect_func_from<PIXEL_FORMAT_RGB565>(dst_format);
+	}
+	return nullptr;
+}
+
+const char *blit_kernel_name() {
+	return kernel().name;
+}
@@ -0,0 +1,58 @@
+#ifndef QT_BLIT_H
+#define QT_BLIT_H
+
+// Rectangle copy kernels for the shared memory paint path
+// These copy damaged rects from the xorgxrdp capture buffer into our
+// framebuffer. The fastest kernel supported by the CPU (AVX2, SSE2 or NEON,
+// with a plain memcpy fallback) is selected once at runtime.
+//
+// When the capture buffer and the framebuffer have different pixel formats,
+// the rect is converted instead. There's a conversion kernel for each pair of
+// formats, specialised at compile time, and the one to use is picked once
+// with blit_rect_func_for.
+
+#include <cstddef>
+#include <cstdint>
+
+// Updates at least this big (in bytes, over all their rects) are copied using
+// non-temporal stores, which skip the cache. Below it, the copied pixels are
+// likely to still be in the cache when they're painted to the screen.
+#define BLIT_NON_TEMPORAL_THRESHOLD (2 * 1024 * 1024)
+
+// Pixel formats of the capture buffer and of framebuffers
+enum pixel_format {
+	// XRDP_a8r8g8b8, the same layout as QImage::Format_RGB32
+	PIXEL_FORMAT_XRGB8888,
+	// XRDP_r5g6b5, the same layout as QImage::Format_RGB16
+	PIXEL_FORMAT_RGB565,
+};
+
+// Parse a capture format given on the command line (named like xrdp names
+// them), returns false if the name is unknown
+bool pixel_format_from_string(const char *name, enum pixel_format *format);
+
+const char *pixel_format_name(enum pixel_format format);
+
+int pixel_format_bytes(enum pixel_format format);
+
+// Copies a cx by cy rect at (x, y) from src to dst, converting it from one
+// pixel format to another.
+// Both buffers use the same coordinate space, with their own strides (in
+// bytes). The rect must already be clipped to both buffers.
+// non_temporal is a hint to skip the cache (see BLIT_NON_TEMPORAL_THRESHOLD),
+// which the caller decides for the whole update the rect is part of.
+typedef void (*blit_rect_func)(
+	uint8_t *dst, size_t dst_stride,
+	const uint8_t *src, size_t src_stride,
+	int x, int y, int cx, int cy,
+	bool non_temporal
+);
+
+// The copy for a pair of formats, which is a plain copy with the kernel
+// selected for this CPU when they're the same
+blit_rect_func blit_rect_func_for(enum pixel_format dst_format, enum pixel_format src_format);
+
+// The name of the kernel selected for this CPU
+const char *blit_kernel_name();
+
+#endif
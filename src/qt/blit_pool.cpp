@@ -0,0 +1,126 @@
+#include <algorithm>
+
+#include "common.h"
+#include "blit_pool.h"
+
+BlitPool::BlitPool(int num_threads) {
+	if (num_threads <= 0) {
+		num_threads = std::min(static_cast<int>(std::thread::hardware_concurrency()), BLIT_POOL_MAX_THREADS);
+	}
+	// The calling thread does its share of the work too
+	for (int i = 1; i < num_threads; i++) {
+		workers.emplace_back(&BlitPool::worker_thread_func, this);
+	}
+	log(LOG_DEBUG, "BlitPool: using %d threads\n", get_num_threads());
+}
+
+BlitPool::~BlitPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_ready.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
+
+int BlitPool::get_num_threads() {
+	return static_cast<int>(workers.size()) + 1;
+}
+
+void BlitPool::split_jobs(const std::vector<blit_rect_spec> &rects, long total_pixels, std::vector<blit_rect_spec> &jobs) {
+	// Aim for a few jobs per thread so threads that finish early can pick up
+	// the slack
+	long job_pixels = std::max(static_cast<long>(BLIT_POOL_MIN_JOB_PIXELS), total_pixels / (get_num_threads() * 4));
+	for (const blit_rect_spec &rect : rects) {
+		long rect_pixels = static_cast<long>(rect.cx) * rect.cy;
+		if (rect_pixels <= job_pixels) {
+			jobs.push_back(rect);
+			continue;
+		}
+		// Split big rects into stripes of whole rows
+		int stripe_rows = std::max(1, static_cast<int>(job_pixels / rect.cx));
+		for (int y = 0; y < rect.cy; y += stripe_rows) {
+			jobs.push_back({
+				.x = rect.x,
+				.y = rect.y + y,
+				.cx = rect.cx,
+				.cy = std::min(stripe_rows, rect.cy - y),
+			});
+		}
+	}
+}
+
+void BlitPool::blit_rects(blit_rect_func blit, uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride, int bytes_per_pixel, const std::vector<blit_rect_spec> &rects) {
+	long total_pixels = 0;
+	for (const blit_rect_spec &rect : rects) {
+		total_pixels += static_cast<long>(rect.cx) * rect.cy;
+	}
+	bool non_temporal = total_pixels * bytes_per_pixel >= BLIT_NON_TEMPORAL_THRESHOLD;
+
+	if (workers.empty() || total_pixels < BLIT_POOL_THRESHOLD) {
+		for (const blit_rect_spec &rect : rects) {
+			blit(dst, dst_stride, src, src_stride, rect.x, rect.y, rect.cx, rect.cy, non_temporal);
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> dispatch_lock(dispatch_mutex);
+
+	auto new_batch = std::make_shared<batch>();
+	new_batch->blit = blit;
+	new_batch->dst = dst;
+	new_batch->dst_stride = dst_stride;
+	new_batch->src = src;
+	new_batch->src_stride = src_stride;
+	new_batch->non_temporal = non_temporal;
+	split_jobs(rects, total_pixels, new_batch->jobs);
+	new_batch->remaining_jobs = new_batch->jobs.size();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		current_batch = new_batch;
+		generation++;
+	}
+	work_ready.notify_all();
+
+	run_jobs(new_batch.get());
+
+	std::unique_lock<std::mutex> lock(mutex);
+	work_done.wait(lock, [&new_batch] { return new_batch->remaining_jobs == 0; });
+	current_batch = nullptr;
+}
+
+void BlitPool::run_jobs(batch *current) {
+	size_t i;
+	while ((i = current->next_job.fetch_add(1)) < current->jobs.size()) {
+		const blit_rect_spec &job = current->jobs[i];
+		current->blit(current->dst, current->dst_stride, current->src, current->src_stride, job.x, job.y, job.cx, job.cy, current->non_temporal);
+		if (current->remaining_jobs.fetch_sub(1) == 1) {
+			// Take the lock so the notification can't slip in between the
+			// dispatcher checking the count and going to sleep
+			std::lock_guard<std::mutex> lock(mutex);
+			work_done.notify_all();
+		}
+	}
+}
+
+void BlitPool::worker_thread_func() {
+	uint64_t seen_generation = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		work_ready.wait(lock, [this, &seen_generation] { return stopping || generation != seen_generation; });
+		if (stopping) {
+			return;
+		}
+		seen_generation = generation;
+		// Keep our own reference, so a late worker can't outlive the batch
+		std::shared_ptr<batch> current = current_batch;
+		lock.unlock();
+		if (current != nullptr) {
+			run_jobs(current.get());
+		}
+		lock.lock();
+	}
+}
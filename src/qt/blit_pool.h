@@ -0,0 +1,100 @@
+#ifndef QT_BLIT_POOL_H
+#define QT_BLIT_POOL_H
+
+// Parallel rect copies
+// Large damage updates (like a compositing window manager repainting the
+// entire screen) are split by rect and by row stripes across a small pool of
+// persistent worker threads. Small updates are copied on the calling thread,
+// where waking up the workers would cost more than it saves.
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "blit.h"
+
+// Updates smaller than this many pixels are copied on the calling thread
+#define BLIT_POOL_THRESHOLD (256 * 1024)
+
+// Each job copies at least this many pixels
+#define BLIT_POOL_MIN_JOB_PIXELS (64 * 1024)
+
+// Memory bandwidth is saturated well before this many threads
+#define BLIT_POOL_MAX_THREADS 8
+
+// A rect to copy, in the coordinate space of both buffers
+struct blit_rect_spec {
+	int x;
+	int y;
+	int cx;
+	int cy;
+};
+
+class BlitPool {
+public:
+	// Uses num_threads threads in total (including the calling thread), or
+	// the number of CPUs (up to BLIT_POOL_MAX_THREADS) if num_threads is 0
+	BlitPool(int num_threads);
+	~BlitPool();
+
+	BlitPool(const BlitPool &) = delete;
+	BlitPool &operator=(const BlitPool &) = delete;
+
+	// Copy all the rects from src to dst with blit (which converts between
+	// their pixel formats, see blit_rect_func_for) and wait for the copy to
+	// finish. bytes_per_pixel is the size of a dst pixel, whether to use
+	// non-temporal stores is decided once from the size of the whole update,
+	// since the jobs it's split into are each too small to reach the
+	// threshold.
+	// The rects must already be clipped to both buffers, and must not overlap
+	// (DamageRegion's never do).
+	void blit_rects(
+		blit_rect_func blit,
+		uint8_t *dst, size_t dst_stride,
+		const uint8_t *src, size_t src_stride,
+		int bytes_per_pixel,
+		const std::vector<blit_rect_spec> &rects
+	);
+
+	int get_num_threads();
+
+private:
+	// A set of jobs dispatched together, shared by the workers
+	struct batch {
+		blit_rect_func blit;
+		uint8_t *dst;
+		size_t dst_stride;
+		const uint8_t *src;
+		size_t src_stride;
+		bool non_temporal;
+		std::vector<blit_rect_spec> jobs;
+		std::atomic<size_t> next_job = 0;
+		std::atomic<size_t> remaining_jobs = 0;
+	};
+
+	// Split rects into jobs of roughly equal size
+	void split_jobs(const std::vector<blit_rect_spec> &rects, long total_pixels, std::vector<blit_rect_spec> &jobs);
+
+	// Run jobs from the batch until there are none left
+	void run_jobs(batch *current);
+
+	void worker_thread_func();
+
+	std::vector<std::thread> workers;
+
+	// Serializes callers, there's only one batch at a time
+	std::mutex dispatch_mutex;
+
+	// Protects everything below
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+	std::shared_ptr<batch> current_batch;
+	uint64_t generation = 0;
+	bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include <algorithm>
+
+#include "damage.h"
+
+DamageRegion::DamageRegion() {
+	bounding_rect = { .x = 0, .y = 0, .cx = 0, .cy = 0 };
+	area = 0;
+}
+
+void DamageRegion::set(const std::vector<blit_rect_spec> &rects) {
+	bands.clear();
+	spans.clear();
+	this->rects.clear();
+	bounding_rect = { .x = 0, .y = 0, .cx = 0, .cy = 0 };
+	area = 0;
+
+	build_bands(rects);
+	if (bands.empty()) {
+		return;
+	}
+	choose_rects();
+}
+
+void DamageRegion::build_bands(const std::vector<blit_rect_spec> &rects) {
+	// Sweep down the rects, a band starts and ends at every top and bottom
+	// edge of a rect
+	sorted.clear();
+	edges.clear();
+	for (const blit_rect_spec &rect : rects) {
+		if (rect.cx <= 0 || rect.cy <= 0) {
+			continue;
+		}
+		sorted.push_back(&rect);
+		edges.push_back(rect.y);
+		edges.push_back(rect.y + rect.cy);
+	}
+	if (sorted.empty()) {
+		return;
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const blit_rect_spec *a, const blit_rect_spec *b) { return a->y < b->y; });
+	std::sort(edges.begin(), edges.end());
+	edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+	int x1 = sorted[0]->x;
+	int x2 = sorted[0]->x + sorted[0]->cx;
+	active.clear();
+	size_t next = 0;
+	for (size_t i = 0; i + 1 < edges.size(); i++) {
+		int y1 = edges[i];
+		int y2 = edges[i + 1];
+
+		active.erase(std::remove_if(active.begin(), active.end(), [y1](const active_rect &rect) { return rect.y2 <= y1; }), active.end());
+		while (next < sorted.size() && sorted[next]->y == y1) {
+			const blit_rect_spec *rect = sorted[next++];
+			active.push_back({ .x1 = rect->x, .x2 = rect->x + rect->cx, .y2 = rect->y + rect->cy });
+		}
+		if (active.empty()) {
+			continue;
+		}
+
+		// Merge the spans of the rects in the band, touching ones included
+		band_spans.clear();
+		for (const active_rect &rect : active) {
+			band_spans.push_back({ .x1 = rect.x1, .x2 = rect.x2 });
+		}
+		std::sort(band_spans.begin(), band_spans.end(), [](const span &a, const span &b) { return a.x1 < b.x1; });
+		size_t merged = 0;
+		for (size_t j = 1; j < band_spans.size(); j++) {
+			if (band_spans[j].x1 <= band_spans[merged].x2) {
+				band_spans[merged].x2 = std::max(band_spans[merged].x2, band_spans[j].x2);
+			} else {
+				band_spans[++merged] = band_spans[j];
+			}
+		}
+		band_spans.resize(merged + 1);
+
+		for (const span &s : band_spans) {
+			area += static_cast<long>(s.x2 - s.x1) * (y2 - y1);
+			x1 = std::min(x1, s.x1);
+			x2 = std::max(x2, s.x2);
+		}
+
+		// Extend the previous band instead if it's right above with the same
+		// spans
+		if (!bands.empty()) {
+			band &previous = bands.back();
+			if (previous.y2 == y1 && previous.num_spans == band_spans.size() &&
+				std::equal(band_spans.begin(), band_spans.end(), spans.begin() + previous.first_span,
+					[](const span &a, const span &b) { return a.x1 == b.x1 && a.x2 == b.x2; })) {
+				previous.y2 = y2;
+				continue;
+			}
+		}
+		bands.push_back({ .y1 = y1, .y2 = y2, .first_span = spans.size(), .num_spans = band_spans.size() });
+		spans.insert(spans.end(), band_spans.begin(), band_spans.end());
+	}
+
+	int y1 = bands.front().y1;
+	int y2 = bands.back().y2;
+	bounding_rect = { .x = x1, .y = y1, .cx = x2 - x1, .cy = y2 - y1 };
+}
+
+void DamageRegion::choose_rects() {
+	long total_cost = 0;
+	for (const band &b : bands) {
+		long height = b.y2 - b.y1;
+		const span &first = spans[b.first_span];
+		const span &last = spans[b.first_span + b.num_spans - 1];
+
+		long spans_cost = 0;
+		for (size_t i = b.first_span; i < b.first_span + b.num_spans; i++) {
+			spans_cost += (spans[i].x2 - spans[i].x1) * height + DAMAGE_RECT_COST + DAMAGE_ROW_COST * height;
+		}
+		long extent_cost = (last.x2 - first.x1) * height + DAMAGE_RECT_COST + DAMAGE_ROW_COST * height;
+
+		if (extent_cost <= spans_cost) {
+			emit_rect(first.x1, b.y1, last.x2, b.y2);
+			total_cost += extent_cost;
+		} else {
+			for (size_t i = b.first_span; i < b.first_span + b.num_spans; i++) {
+				emit_rect(spans[i].x1, b.y1, spans[i].x2, b.y2);
+			}
+			total_cost += spans_cost;
+		}
+	}
+
+	long bounding_cost = static_cast<long>(bounding_rect.cx) * bounding_rect.cy + DAMAGE_RECT_COST + DAMAGE_ROW_COST * bounding_rect.cy;
+	if (bounding_cost <= total_cost) {
+		rects.clear();
+		rects.push_back(bounding_rect);
+	}
+}
+
+void DamageRegion::emit_rect(int x1, int y1, int x2, int y2) {
+	// Bands that were kept apart because their spans differ can end up with
+	// the same extent. The spans of a band never overlap, so neither do the
+	// merged rects.
+	if (!rects.empty()) {
+		blit_rect_spec &previous = rects.back();
+		if (previous.x == x1 && previous.cx == x2 - x1 && previous.y + previous.cy == y1) {
+			previous.cy = y2 - previous.y;
+			return;
+		}
+	}
+	rects.push_back({ .x = x1, .y = y1, .cx = x2 - x1, .cy = y2 - y1 });
+}
+
+const std::vector<blit_rect_spec> &DamageRegion::get_rects() {
+	return rects;
+}
+
+const blit_rect_spec &DamageRegion::get_bounding_rect() {
+	return bounding_rect;
+}
+
+long DamageRegion::get_area() {
+	return area;
+}
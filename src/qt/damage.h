@@ -0,0 +1,92 @@
+#ifndef QT_DAMAGE_H
+#define QT_DAMAGE_H
+
+// Damage region simplification
+// xorgxrdp sends damage the way the X server accumulated it, which for text
+// rendering or a scrolling terminal can be hundreds of tiny rects that overlap
+// or touch each other. Copying and presenting those one by one costs more in
+// per-rect overhead than in pixels, and overlapping rects are copied twice.
+//
+// DamageRegion turns a rect list into y-x bands (like X11 regions): bands of
+// rows, each with sorted, non-overlapping spans, where vertically adjacent
+// bands with the same spans are merged. Then, using a simple cost model, it
+// decides for each band whether to copy its spans or the band's whole extent,
+// and for the whole region whether to just copy its bounding rect.
+// Copying more than what was damaged is fine, the capture buffer always holds
+// the whole screen.
+
+#include <vector>
+
+#include "blit_pool.h"
+
+// The cost of copying a rect on top of its pixels, in pixels (looking it up,
+// splitting it into jobs, presenting it)
+#define DAMAGE_RECT_COST 512
+
+// The cost of each row of a rect on top of its pixels, in pixels (setting up
+// the row's copy and the partially used cache lines at its ends)
+#define DAMAGE_ROW_COST 16
+
+class DamageRegion {
+public:
+	DamageRegion();
+
+	// Replace the region with the union of the given rects, which must be
+	// clipped to the framebuffer already
+	void set(const std::vector<blit_rect_spec> &rects);
+
+	// The rects to copy, they don't overlap and cover the region (and maybe
+	// a bit more, where that's cheaper)
+	const std::vector<blit_rect_spec> &get_rects();
+
+	// The bounding rect of the region, empty if the region is
+	const blit_rect_spec &get_bounding_rect();
+
+	// The number of pixels in the region, without the extra pixels the rects
+	// may cover
+	long get_area();
+
+private:
+	struct span {
+		int x1;
+		int x2;
+	};
+
+	struct band {
+		int y1;
+		int y2;
+		size_t first_span;
+		size_t num_spans;
+	};
+
+	// A rect that's in the band being built, with the bottom it ends at
+	struct active_rect {
+		int x1;
+		int x2;
+		int y2;
+	};
+
+	// Build the bands from the rects
+	void build_bands(const std::vector<blit_rect_spec> &rects);
+
+	// Pick the rects to copy from the bands
+	void choose_rects();
+
+	// Add a rect to the output, merging it into the previous one if that's
+	// right above it with the same horizontal extent
+	void emit_rect(int x1, int y1, int x2, int y2);
+
+	std::vector<band> bands;
+	std::vector<span> spans;
+	std::vector<blit_rect_spec> rects;
+	blit_rect_spec bounding_rect;
+	long area;
+
+	// Scratch space for build_bands, kept to avoid reallocating
+	std::vector<const blit_rect_spec *> sorted;
+	std::vector<int> edges;
+	std::vector<active_rect> active;
+	std::vector<span> band_spans;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include "damage_history.h"
+
+void DamageHistory::clear() {
+	history.clear();
+}
+
+QRect DamageHistory::add_frame(const QRect &changed, int age, const QRect &whole) {
+	// A buffer age frames old misses the damage of the age - 1 frames drawn
+	// after it, on top of this one's
+	QRect repair = whole;
+	if (age > 0 && static_cast<size_t>(age - 1) <= history.size()) {
+		repair = changed;
+		for (int i = 0; i < age - 1; i++) {
+			repair = repair.united(history[i]);
+		}
+	}
+	history.push_front(changed);
+	if (history.size() > EGL_DAMAGE_HISTORY) {
+		history.pop_back();
+	}
+	return repair;
+}
+
+QRect window_damage(const std::vector<QRect> *damage, const QRect &geometry) {
+	if (damage == nullptr) {
+		return QRect(QPoint(0, 0), geometry.size());
+	}
+	QRect changed;
+	for (const QRect &rect : *damage) {
+		QRect visible = rect.intersected(geometry);
+		if (!visible.isEmpty()) {
+			changed = changed.united(visible.translated(-geometry.topLeft()));
+		}
+	}
+	return changed;
+}
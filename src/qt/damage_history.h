@@ -0,0 +1,40 @@
+#ifndef QT_DAMAGE_HISTORY_H
+#define QT_DAMAGE_HISTORY_H
+
+// Buffer age damage tracking for the DMA-BUF windows
+// A back buffer EGL gives us holds the window as it was some frames ago (its
+// buffer age, EGL_EXT_buffer_age), so drawing a frame into it has to redraw
+// what changed in this frame and in every frame since it was last shown.
+// This is kept apart from EGLState so it can be tested without a GPU.
+
+#include <deque>
+#include <vector>
+#include <QRect>
+
+// How many frames of damage to remember per window, back buffers older than
+// that are redrawn whole (drivers rarely keep more than 3 buffers)
+#define EGL_DAMAGE_HISTORY 4
+
+class DamageHistory {
+public:
+	// Forget every frame, the next back buffer is redrawn whole whatever its
+	// age (e.g. when the window starts showing another image)
+	void clear();
+
+	// Record changed (in window coordinates) as the damage of the frame
+	// about to be drawn, and return what has to be redrawn in a back buffer
+	// age frames old, 0 if its age is unknown. That's all of whole when
+	// the buffer is older than what we remember.
+	QRect add_frame(const QRect &changed, int age, const QRect &whole);
+
+private:
+	// The damage of the last frames, most recent first
+	std::deque<QRect> history;
+};
+
+// The part of damage (in session coordinates, null if unknown) the window at
+// geometry shows, in window coordinates: all of the window if damage is null,
+// and empty if none of it is in the window
+QRect window_damage(const std::vector<QRect> *damage, const QRect &geometry);
+
+#endif
@@ -1,69 +1,68 @@
-#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
 #include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
 
 #include "common.h"
 
 #include "egl.h"
+#include "gl_renderer.h"
 
-bool EGLState::is_supported(const char *x11_display) {
-	EGLDisplay eglDisplay;
+EGLWindow::EGLWindow(const EGLCapabilities *caps, int window_id, bool allow_gles, EGLContext share_context) {
+	this->caps = caps;
+	this->window_id = window_id;
+	egl_display = caps->display;
 
-	if (x11_display[0] != ':') {
-		log(LOG_WARN, "DMA-BUF not supported on remote X11 display (%s), disabling DMA-BUF.\n", x11_display);
-		return false;
-	}
-
-	intptr_t x11_display_num = atoi(&x11_display[1]);
-
-	eglDisplay = eglGetDisplay(reinterpret_cast<EGLNativeDisplayType>(x11_display_num));
-	if (eglDisplay == EGL_NO_DISPLAY) {
-		log(LOG_INFO, "eglGetDisplay failed, disabling DMA-BUF.\n");
-		return false;
-	}
+	try {
+		// Prefer desktop GL, which everything we do works on
+		if (!create_context(EGL_OPENGL_API, share_context) && (!allow_gles || !create_context(EGL_OPENGL_ES_API, share_context))) {
+			throw std::runtime_error("eglCreateContext failed");
+		}
+		log(LOG_DEBUG, "EGLWindow: using a %s context\n", is_gles() ? "GLES 2" : "desktop GL");
 
-	if (eglInitialize(eglDisplay, nullptr, nullptr) == EGL_FALSE) {
-		log(LOG_INFO, "EGL failed to initialize, disabling DMA-BUF.\n");
-		return false;
+		make_current();
+	} catch (...) {
+		cleanup();
+		throw;
 	}
+}
 
-	eglTerminate(eglDisplay);
+EGLWindow::~EGLWindow() {
+	cleanup();
+}
 
-	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR =
-		reinterpret_cast<PFNEGLCREATEIMAGEKHRPROC>(eglGetProcAddress("eglCreateImageKHR"));
-	if (eglCreateImageKHR == nullptr) {
-		log(LOG_INFO, "EGL EGL_KHR_gl_texture_2D_image extension not supported, DMA-BUF not supported.\n");
-		return false;
-	}
-	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC eglImageTargetTexture2DOES =
-		reinterpret_cast<PFNGLEGLIMAGETARGETTEXTURE2DOESPROC>(eglGetProcAddress("glEGLImageTargetTexture2DOES"));
-			eglGetProcAddress("glEGLImageTargetTexture2DOES");
-	if (eglImageTargetTexture2DOES == nullptr) {
-		log(LOG_INFO, "EGL EGL_EXT_image_dma_buf_import extension not supported, DMA-BUF not supported.\n");
-		return false;
+void EGLWindow::cleanup() {
+	if (egl_display == EGL_NO_DISPLAY) {
+		return;
 	}
 
-	log(LOG_INFO, "DMA-BUF acceleration is supported by xrdp and our environment, trying to enable...\n");
-	return true;
-}
-
-EGLState::EGLState(const char *x11_display, int window_id, int fd, uint32_t width, uint32_t height, uint16_t stride, uint32_t size, uint32_t format) {
-	int numConfigs = 0;
+	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 
-	log(LOG_DEBUG, "EGLState: %s, %d, %d, %d, %d, %d, %d, %X\n", x11_display, window_id, fd, width, height, stride, size, format);
+	release_surface();
 
-	if (x11_display[0] != ':') {
-		throw std::runtime_error("DMA-BUF not supported on remote X11 display.");
+	if (egl_context != EGL_NO_CONTEXT) {
+		eglDestroyContext(egl_display, egl_context);
+		egl_context = EGL_NO_CONTEXT;
 	}
 
-	intptr_t x11_display_num = atoi(&x11_display[1]);
+	egl_display = EGL_NO_DISPLAY;
 
-	this->width = width;
-	this->height = height;
+	eglReleaseThread();
+}
 
+bool EGLWindow::create_context(EGLenum api, EGLContext share_context) {
 	int egl_config_attribs[] = {
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
 		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RENDERABLE_TYPE, api == EGL_OPENGL_ES_API ? EGL_OPENGL_ES2_BIT : EGL_OPENGL_BIT,
 		EGL_NONE,
 	};
 	int egl_ctx_attribs[] = {
@@ -71,152 +70,549 @@ EGLState::EGLState(const char *x11_display, int window_id, int fd, uint32_t widt
 		EGL_NONE,
 	};
 
-	egl_display = eglGetDisplay(reinterpret_cast<EGLNativeDisplayType>(x11_display_num));
-	if (egl_display == EGL_NO_DISPLAY) {
-		throw std::runtime_error("eglGetDisplay failed");
-	}
-
-	if (eglInitialize(egl_display, nullptr, nullptr) == EGL_FALSE) {
-		eglTerminate(egl_display);
-		throw std::runtime_error("eglInitialize failed");
-	}
-
-	if (eglBindAPI(EGL_OPENGL_API) == EGL_FALSE) {
-		eglTerminate(egl_display);
-		throw std::runtime_error("eglBindAPI failed");
+	// The bound API is per thread, so this has to be done by every thread
+	// that creates a context
+	if (eglBindAPI(api) == EGL_FALSE) {
+		return false;
 	}
 
-	if (eglChooseConfig(egl_display, egl_config_attribs, &egl_config, 1, &numConfigs) == EGL_FALSE) {
-		eglTerminate(egl_display);
-		throw std::runtime_error("eglChooseConfig failed");
+	int num_configs = 0;
+	if (eglChooseConfig(egl_display, egl_config_attribs, &egl_config, 1, &num_configs) == EGL_FALSE || num_configs == 0) {
+		return false;
 	}
 
-	egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, egl_ctx_attribs);
+	// Sharing fails if the other context is of another API, which makes us
+	// try the next one
+	egl_context = eglCreateContext(egl_display, egl_config, share_context, egl_ctx_attribs);
 	if (egl_context == EGL_NO_CONTEXT) {
-		eglTerminate(egl_display);
-		throw std::runtime_error("eglCreateContext failed");
+		return false;
 	}
+	egl_api = api;
+	return true;
+}
 
+void EGLWindow::create_surface() {
 	egl_surface = eglCreateWindowSurface(egl_display, egl_config,
 										static_cast<EGLNativeWindowType>(window_id), nullptr);
 	if (egl_surface == EGL_NO_SURFACE) {
-		eglDestroyContext(egl_display, egl_context);
-		eglTerminate(egl_display);
 		throw std::runtime_error("eglCreateWindowSurface failed");
 	}
+}
 
-	eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context);
+void EGLWindow::make_current() {
+	if (egl_surface == EGL_NO_SURFACE) {
+		create_surface();
+	}
+	// The bound API is per thread, and we may be used from another thread
+	// than the one that created the context
+	eglBindAPI(egl_api);
+	if (eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context) == EGL_FALSE) {
+		throw std::runtime_error("eglMakeCurrent failed");
+	}
+}
 
-	import_dma_buf_fd(fd, width, height, stride, size, format);
-	setup_gl_state();
+bool EGLWindow::make_current_surfaceless() {
+	if (!caps->surfaceless_context) {
+		return false;
+	}
+	eglBindAPI(egl_api);
+	return eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context) == EGL_TRUE;
 }
 
-EGLState::~EGLState() {
-	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+void EGLWindow::release_current() {
+	if (eglGetCurrentContext() == egl_context) {
+		eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	}
+}
 
-	if (egl_image != EGL_NO_IMAGE_KHR) {
-		PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR = reinterpret_cast<PFNEGLDESTROYIMAGEKHRPROC>(eglGetProcAddress("eglDestroyImageKHR"));
-		if (eglDestroyImageKHR != nullptr) {
-			eglDestroyImageKHR(egl_display, egl_image);
-			egl_image = EGL_NO_IMAGE_KHR;
-		}
+void EGLWindow::swap_buffers() {
+	eglSwapBuffers(egl_display, egl_surface);
+}
+
+int EGLWindow::get_buffer_age() {
+	EGLint age = 0;
+	if (!caps->buffer_age || eglQuerySurface(egl_display, egl_surface, EGL_BUFFER_AGE_KHR, &age) == EGL_FALSE) {
+		return 0;
 	}
+	return age;
+}
+
+void EGLWindow::to_egl_rect(const QRect &rect, EGLint *egl_rect) {
+	EGLint surface_height = 0;
+	eglQuerySurface(egl_display, egl_surface, EGL_HEIGHT, &surface_height);
+	egl_rect[0] = rect.x();
+	egl_rect[1] = surface_height - rect.y() - rect.height();
+	egl_rect[2] = rect.width();
+	egl_rect[3] = rect.height();
+}
 
-	if (texture != 0) {
-		glDeleteTextures(1, &texture);
-		texture = 0;
+void EGLWindow::set_damage_region(const QRect &rect) {
+	if (caps->egl_set_damage_region == nullptr) {
+		return;
 	}
+	EGLint egl_rect[4];
+	to_egl_rect(rect, egl_rect);
+	caps->egl_set_damage_region(egl_display, egl_surface, egl_rect, 1);
+}
 
+void EGLWindow::swap_buffers_with_damage(const QRect &rect) {
+	if (caps->egl_swap_buffers_with_damage == nullptr) {
+		swap_buffers();
+		return;
+	}
+	EGLint egl_rect[4];
+	to_egl_rect(rect, egl_rect);
+	caps->egl_swap_buffers_with_damage(egl_display, egl_surface, egl_rect, 1);
+}
+
+void EGLWindow::release_surface() {
+	// The context (and everything in it) survives this, make_current binds
+	// it again with a new surface
+	release_current();
 	if (egl_surface != EGL_NO_SURFACE) {
 		eglDestroySurface(egl_display, egl_surface);
 		egl_surface = EGL_NO_SURFACE;
 	}
+}
 
-	if (egl_context != EGL_NO_CONTEXT) {
-		eglDestroyContext(egl_display, egl_context);
-		egl_context = EGL_NO_CONTEXT;
+bool EGLWindow::has_surface() {
+	return egl_surface != EGL_NO_SURFACE;
+}
+
+EGLDisplay EGLWindow::get_display() {
+	return egl_display;
+}
+
+EGLContext EGLWindow::get_context() const {
+	return egl_context;
+}
+
+bool EGLWindow::is_gles() {
+	return egl_api == EGL_OPENGL_ES_API;
+}
+
+EGLState::EGLState(const EGLCapabilities *caps, int window_id, const QRect &geometry, const EGLState *share) :
+	caps(caps),
+	share(share),
+	window(caps, window_id, true, share != nullptr ? share->window.get_context() : EGL_NO_CONTEXT),
+	rendering_frames("DMA-BUF frames drawn while the X server was still rendering them", "frames", STATS_LOG_EVERY),
+	rendering_wait("GPU wait for the X server's rendering", "us", STATS_LOG_EVERY)
+{
+	log(LOG_DEBUG, "EGLState: window at %dx%d, %dx%d, %s\n", geometry.x(), geometry.y(), geometry.width(), geometry.height(), share != nullptr ? "sharing" : "importing");
+
+	this->geometry = geometry;
+
+	try {
+		renderer = new GLRenderer();
+		glViewport(0, 0, geometry.width(), geometry.height());
+	} catch (...) {
+		cleanup();
+		throw;
+	}
+}
+
+EGLState::~EGLState() {
+	cleanup();
+}
+
+void EGLState::cleanup() {
+	release_pixmap_sync();
+
+	// GL objects need the context current, which takes
+	// EGL_KHR_surfaceless_context once the presenter has the window back.
+	// Otherwise they're freed with the context.
+	bool current = false;
+	try {
+		if (window.has_surface()) {
+			window.make_current();
+			current = true;
+		} else {
+			current = window.make_current_surfaceless();
+		}
+	} catch (const std::exception &e) {
+		log(LOG_DEBUG, "EGLState: can't make the context current to clean up: %s\n", e.what());
 	}
 
-	if (egl_display != EGL_NO_DISPLAY) {
-		eglTerminate(egl_display);
-		egl_display = EGL_NO_DISPLAY;
+	if (renderer != nullptr) {
+		if (!current) {
+			renderer->abandon();
+		}
+		delete renderer;
+		renderer = nullptr;
 	}
 
-	eglReleaseThread();
+	for (struct pooled_image &entry : image_pool) {
+		free_pooled_image(entry, current);
+	}
+	image_pool.clear();
+	texture = 0;
+	bound = false;
 }
 
-void EGLState::import_dma_buf_fd(int fd, uint32_t width, uint32_t height, uint16_t stride, uint32_t size, uint32_t format) {
-	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR =
-		reinterpret_cast<PFNEGLCREATEIMAGEKHRPROC>(eglGetProcAddress("eglCreateImageKHR"));
-	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC eglImageTargetTexture2DOES =
-		reinterpret_cast<PFNGLEGLIMAGETARGETTEXTURE2DOESPROC>(eglGetProcAddress("glEGLImageTargetTexture2DOES"));
-	if (eglCreateImageKHR == nullptr || eglImageTargetTexture2DOES == nullptr) {
-		throw std::runtime_error("eglCreateImageKHR or eglImageTargetTexture2DOES not supported.");
+void EGLState::bind(const struct dma_buf_image &image) {
+	// This creates the surface again if unbind released it
+	window.make_current();
+	release_pixmap_sync();
+	bound = false;
+
+	if (share != nullptr) {
+		if (share->texture == 0) {
+			throw std::runtime_error("the shared pixmap texture isn't bound");
+		}
+		texture = share->texture;
+	} else {
+		texture = get_pooled_texture(image);
 	}
+	width = image.width;
+	height = image.height;
 
-	EGLint attrs[] = {
-		EGL_WIDTH, static_cast<EGLint>(width),
-		EGL_HEIGHT, static_cast<EGLint>(height),
-		EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLint>(format),
-		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(stride),
-		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-		EGL_NONE,
+	// The surface may be new, and if it isn't, what it shows is from another
+	// image, so nothing from the previous frames can be relied on
+	damage_history.clear();
+
+	// All planes of the pixmap are in the same buffer object
+	setup_explicit_sync(image.planes[0].fd);
+	bound = true;
+}
+
+void EGLState::unbind() {
+	bound = false;
+	release_pixmap_sync();
+	// Pooled textures stay, but whoever shares ours has to bind again after
+	// we do
+	texture = 0;
+	window.release_surface();
+}
+
+struct EGLState::pooled_image EGLState::identify_image(const struct dma_buf_image &image) {
+	if (image.num_planes < 1 || image.num_planes > DMA_BUF_MAX_PLANES) {
+		throw std::runtime_error("Invalid number of DMA-BUF planes");
+	}
+	struct pooled_image entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.image = image;
+	entry.egl_image = EGL_NO_IMAGE_KHR;
+	for (int i = 0; i < image.num_planes; i++) {
+		struct stat st;
+		if (fstat(image.planes[i].fd, &st) != 0) {
+			throw std::runtime_error("can't stat a DMA-BUF plane");
+		}
+		entry.devices[i] = st.st_dev;
+		entry.inodes[i] = st.st_ino;
+	}
+	return entry;
+}
+
+bool EGLState::is_same_image(const struct pooled_image &a, const struct pooled_image &b) {
+	if (a.image.width != b.image.width || a.image.height != b.image.height ||
+		a.image.format != b.image.format || a.image.modifier != b.image.modifier ||
+		a.image.num_planes != b.image.num_planes) {
+		return false;
+	}
+	// The fds are different every time the buffer is sent
+	for (int i = 0; i < a.image.num_planes; i++) {
+		if (a.devices[i] != b.devices[i] || a.inodes[i] != b.inodes[i] ||
+			a.image.planes[i].offset != b.image.planes[i].offset ||
+			a.image.planes[i].pitch != b.image.planes[i].pitch) {
+			return false;
+		}
+	}
+	return true;
+}
+
+GLuint EGLState::get_pooled_texture(const struct dma_buf_image &image) {
+	struct pooled_image key = identify_image(image);
+	pool_clock++;
+	for (struct pooled_image &entry : image_pool) {
+		if (is_same_image(entry, key)) {
+			entry.last_used = pool_clock;
+			log(LOG_DEBUG, "EGLState: reusing the imported image, texture %d\n", entry.texture);
+			return entry.texture;
+		}
+	}
+
+	if (image_pool.size() >= EGL_IMAGE_POOL_SIZE) {
+		// The other monitors may still be drawing the texture we're bound
+		// to, until they're bound to the new one
+		auto oldest = image_pool.end();
+		for (auto it = image_pool.begin(); it != image_pool.end(); it++) {
+			if (it->texture != texture && (oldest == image_pool.end() || it->last_used < oldest->last_used)) {
+				oldest = it;
+			}
+		}
+		if (oldest != image_pool.end()) {
+			free_pooled_image(*oldest, true);
+			image_pool.erase(oldest);
+		}
+	}
+
+	import_dma_buf(image, key);
+	key.last_used = pool_clock;
+	image_pool.push_back(key);
+	return key.texture;
+}
+
+void EGLState::free_pooled_image(struct pooled_image &entry, bool current) {
+	if (entry.texture != 0 && current) {
+		glDeleteTextures(1, &entry.texture);
+	}
+	entry.texture = 0;
+	if (entry.egl_image != EGL_NO_IMAGE_KHR) {
+		caps->egl_destroy_image(window.get_display(), entry.egl_image);
+		entry.egl_image = EGL_NO_IMAGE_KHR;
+	}
+}
+
+void EGLState::import_dma_buf(const struct dma_buf_image &image, struct pooled_image &entry) {
+	if (!caps->dma_buf_import) {
+		throw std::runtime_error("the driver can't import DMA-BUF images");
+	}
+
+	bool has_modifier = image.modifier != DMA_BUF_MOD_INVALID;
+	if (has_modifier && !caps->dma_buf_modifiers) {
+		throw std::runtime_error("the driver can't import DMA-BUF images with a modifier");
+	}
+
+	static const EGLint plane_attrs[DMA_BUF_MAX_PLANES][5] = {
+		{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+	};
+	std::vector<EGLint> attrs = {
+		EGL_WIDTH, static_cast<EGLint>(image.width),
+		EGL_HEIGHT, static_cast<EGLint>(image.height),
+		EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLint>(image.format),
 	};
-	egl_image = eglCreateImageKHR(
-		egl_display,
+	for (int i = 0; i < image.num_planes; i++) {
+		const struct dma_buf_plane &plane = image.planes[i];
+		attrs.insert(attrs.end(), {
+			plane_attrs[i][0], plane.fd,
+			plane_attrs[i][1], static_cast<EGLint>(plane.offset),
+			plane_attrs[i][2], static_cast<EGLint>(plane.pitch),
+		});
+		if (has_modifier) {
+			attrs.insert(attrs.end(), {
+				plane_attrs[i][3], static_cast<EGLint>(image.modifier & 0xffffffff),
+				plane_attrs[i][4], static_cast<EGLint>(image.modifier >> 32),
+			});
+		}
+	}
+	attrs.push_back(EGL_NONE);
+
+	log(LOG_DEBUG, "EGLState: importing a %dx%d image, format %X, modifier %" PRIX64 ", %d planes\n", image.width, image.height, image.format, image.modifier, image.num_planes);
+
+	entry.egl_image = caps->egl_create_image(
+		window.get_display(),
 		EGL_NO_CONTEXT,
 		EGL_LINUX_DMA_BUF_EXT,
 		static_cast<EGLClientBuffer>(nullptr),
-		attrs
+		attrs.data()
 	);
-	if (egl_image == EGL_NO_IMAGE_KHR)
-	{
+	if (entry.egl_image == EGL_NO_IMAGE_KHR) {
 		throw std::runtime_error("Failed to create EGLImage from dma_buf");
-		return;
 	}
 
-	glGenTextures(1, &texture);
-	if (texture == 0) {
+	glGenTextures(1, &entry.texture);
+	if (entry.texture == 0) {
+		free_pooled_image(entry, true);
 		throw std::runtime_error("glGenTextures failed");
 	}
 
-	glBindTexture(GL_TEXTURE_2D, texture);
+	glBindTexture(GL_TEXTURE_2D, entry.texture);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	eglImageTargetTexture2DOES(GL_TEXTURE_2D, egl_image);
+	caps->gl_image_target_texture_2d(GL_TEXTURE_2D, entry.egl_image);
+
+	// The other monitors' contexts use the texture as soon as we're bound,
+	// and changes to shared objects are only visible to other contexts once
+	// they're done
+	glFinish();
+
+	log(LOG_DEBUG, "EGLState: import_dma_buf: success, texture is %d.\n", entry.texture);
+}
+
+// Get the fences of the pending writes to a DMA-BUF as a sync_file, or -1 if
+// the kernel can't (before Linux 6.0), or we were built against headers older
+// than that
+static int export_write_fences(int dma_buf_fd) {
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file args = { .flags = DMA_BUF_SYNC_READ, .fd = -1 };
+	if (ioctl(dma_buf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args) != 0) {
+		return -1;
+	}
+	return args.fd;
+#else
+	return -1;
+#endif
+}
+
+static bool fence_signaled(int fence_fd) {
+	struct pollfd pfd = { .fd = fence_fd, .events = POLLIN, .revents = 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+// When the last fence of a signaled sync_file signaled, in CLOCK_MONOTONIC
+// nanoseconds, or 0 if the kernel doesn't tell
+static uint64_t fence_signal_time(int fence_fd) {
+	struct sync_file_info info;
+	memset(&info, 0, sizeof(info));
+	if (ioctl(fence_fd, SYNC_IOC_FILE_INFO, &info) != 0 || info.num_fences == 0) {
+		return 0;
+	}
+	std::vector<struct sync_fence_info> fences(info.num_fences);
+	info.sync_fence_info = reinterpret_cast<uintptr_t>(fences.data());
+	if (ioctl(fence_fd, SYNC_IOC_FILE_INFO, &info) != 0) {
+		return 0;
+	}
+	uint64_t latest = 0;
+	for (const struct sync_fence_info &fence : fences) {
+		latest = std::max(latest, static_cast<uint64_t>(fence.timestamp_ns));
+	}
+	return latest;
+}
 
-	log(LOG_DEBUG, "EGLState: import_dma_buf_fd: success, texture is %d.\n", texture);
+static uint64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
 }
 
-void EGLState::setup_gl_state() {
-	// Set up GL state
-	glViewport(0, 0, width, height);
+void EGLState::setup_explicit_sync(int fd) {
+	// EGLCapabilities already said so if EGL can't wait for fences, and the
+	// kernel won't learn to export them between binds
+	if (!caps->native_fence_sync || (fences_probed && !kernel_fences)) {
+		return;
+	}
+
+	dma_buf_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dma_buf_fd < 0) {
+		return;
+	}
+	int fence_fd = export_write_fences(dma_buf_fd);
+	if (fence_fd < 0) {
+		if (!fences_probed) {
+			log(LOG_INFO, "The kernel can't export DMA-BUF fences, relying on implicit synchronization for DMA-BUF.\n");
+			fences_probed = true;
+		}
+		close(dma_buf_fd);
+		dma_buf_fd = -1;
+		return;
+	}
+	close(fence_fd);
+
+	if (!fences_probed) {
+		log(LOG_DEBUG, "EGLState: synchronizing with the X server's rendering explicitly\n");
+		fences_probed = true;
+		kernel_fences = true;
+	}
+	explicit_sync = true;
+}
+
+void EGLState::release_pixmap_sync() {
+	explicit_sync = false;
+	if (pending_fence_fd >= 0) {
+		close(pending_fence_fd);
+		pending_fence_fd = -1;
+	}
+	if (dma_buf_fd >= 0) {
+		close(dma_buf_fd);
+		dma_buf_fd = -1;
+	}
+}
+
+void EGLState::wait_for_pixmap() {
+	if (!explicit_sync) {
+		return;
+	}
+	account_pixmap_wait();
+
+	int fence_fd = export_write_fences(dma_buf_fd);
+	if (fence_fd < 0) {
+		return;
+	}
+	if (fence_signaled(fence_fd)) {
+		// The usual case, the X server is done by the time it tells us to
+		// paint
+		rendering_frames.add(0);
+		close(fence_fd);
+		return;
+	}
+	rendering_frames.add(1);
+	if (pending_fence_fd < 0) {
+		pending_fence_fd = dup(fence_fd);
+		pending_since_ns = monotonic_ns();
+	}
 
-	// Set up orthographic 2D projection
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0.0, width, 0.0, height, -1.0, 1.0);
+	EGLint attrs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fence_fd,
+		EGL_NONE,
+	};
+	EGLSyncKHR sync = caps->egl_create_sync(window.get_display(), EGL_SYNC_NATIVE_FENCE_ANDROID, attrs);
+	if (sync == EGL_NO_SYNC_KHR) {
+		// EGL only takes the fd when it succeeds
+		close(fence_fd);
+		log(LOG_WARN, "EGLState: can't import the X server's fences, relying on implicit synchronization for DMA-BUF\n");
+		explicit_sync = false;
+		return;
+	}
+	// This only makes the GPU wait before running what we submit next
+	caps->egl_wait_sync(window.get_display(), sync, 0);
+	caps->egl_destroy_sync(window.get_display(), sync);
+}
 
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+void EGLState::account_pixmap_wait() {
+	if (pending_fence_fd < 0 || !fence_signaled(pending_fence_fd)) {
+		return;
+	}
+	uint64_t signaled_ns = fence_signal_time(pending_fence_fd);
+	if (signaled_ns > pending_since_ns) {
+		rendering_wait.add((signaled_ns - pending_since_ns) / 1000);
+	}
+	close(pending_fence_fd);
+	pending_fence_fd = -1;
+}
 
-	glEnable(GL_TEXTURE_2D);
+void EGLState::setup_scissor(const QRect &rect) {
+	if (rect == QRect(QPoint(0, 0), geometry.size())) {
+		if (scissor_enabled) {
+			glDisable(GL_SCISSOR_TEST);
+			scissor_enabled = false;
+		}
+		return;
+	}
+	// GL window coordinates start from the bottom left
+	glScissor(rect.x(), geometry.height() - rect.y() - rect.height(), rect.width(), rect.height());
+	if (!scissor_enabled) {
+		glEnable(GL_SCISSOR_TEST);
+		scissor_enabled = true;
+	}
 }
 
-void EGLState::render() {
-	// Enable 2D texturing
-	glBindTexture(GL_TEXTURE_2D, texture);
+void EGLState::render(const std::vector<QRect> *damage) {
+	if (!bound) {
+		return;
+	}
+	QRect changed = window_damage(damage, geometry);
+	if (changed.isEmpty()) {
+		// Nothing to draw or present, and since there's no swap the buffer
+		// age stays the same
+		return;
+	}
+
+	wait_for_pixmap();
+
+	// The back buffer holds the window as it was age frames ago, so whatever
+	// changed since has to be redrawn too
+	QRect repair = damage_history.add_frame(changed, window.get_buffer_age(), QRect(QPoint(0, 0), geometry.size()));
 
-	// Draw a fullscreen quad with the texture
-	glBegin(GL_QUADS);
-		glTexCoord2f(0.0f, 1.0f); glVertex2f(0.0f, 0.0f);
-		glTexCoord2f(1.0f, 1.0f); glVertex2f(static_cast<GLfloat>(width), 0.0f);
-		glTexCoord2f(1.0f, 0.0f); glVertex2f(static_cast<GLfloat>(width), static_cast<GLfloat>(height));
-		glTexCoord2f(0.0f, 0.0f); glVertex2f(0.0f, static_cast<GLfloat>(height));
-	glEnd();
+	window.set_damage_region(repair);
+	setup_scissor(repair);
+
+	// Cover the window with its part of the texture
+	renderer->draw(texture, geometry, width, height);
 
 	// display the rendered image
-	eglSwapBuffers(egl_display, egl_surface);
+	window.swap_buffers_with_damage(changed);
 }
@@ -1,59 +1,292 @@
 #ifndef QT_EGL_H
 #define QT_EGL_H
 
-#define USE_X11
-#include <GL/gl.h>
-#include <EGL/egl.h>
-#include <EGL/eglext.h>
+#include <sys/types.h>
+#include <vector>
+#include <QRect>
 
-// This is the EGL state for the window, if DMA-BUF is enabled, this will keep
+#include "damage_history.h"
+#include "egl_caps.h"
+#include "stats.h"
+
+class GLRenderer;
+
+// The most planes a DMA-BUF image can have (EGL_EXT_image_dma_buf_import)
+#define DMA_BUF_MAX_PLANES 4
+
+// DRM_FORMAT_MOD_INVALID, the modifier of images whose layout the exporter
+// didn't tell, the driver then assumes its implicit one
+#define DMA_BUF_MOD_INVALID 0x00ffffffffffffffULL
+
+// How many imported DMA-BUF images to keep for when xorgxrdp sends them again
+#define EGL_IMAGE_POOL_SIZE 4
+
+struct dma_buf_plane {
+	int fd;
+	uint32_t offset;
+	uint32_t pitch;
+};
+
+// A DMA-BUF image exported by the X server
+struct dma_buf_image {
+	uint32_t width;
+	uint32_t height;
+	// DRM fourcc
+	uint32_t format;
+	// DRM format modifier (tiling, compression), the same for every plane
+	uint64_t modifier;
+	int num_planes;
+	struct dma_buf_plane planes[DMA_BUF_MAX_PLANES];
+};
+
+// An EGL context rendering to a window, used both to display the DMA-BUF
+// pixmap (one per monitor) and by the GL presenter.
+// Swaps wait for the vblank of the window's monitor (the default swap
+// interval), which is fine since every window has its own context and thread.
+// The context is current on the thread that created it until release_current
+// is called, after which another thread can make it current. Only one EGL
+// surface can exist for a window at a time, so whoever else wants to render
+// to the window has to release_surface first.
+class EGLWindow {
+public:
+	// Throws std::runtime_error if a context can't be created
+	// The context is a desktop GL one, or if allow_gles is set and the driver
+	// only does GLES (like v3d), a GLES 2 one.
+	// caps must outlive us
+	// If share_context is given, the context shares its objects (like
+	// textures) with it
+	EGLWindow(const EGLCapabilities *caps, int window_id, bool allow_gles = false, EGLContext share_context = EGL_NO_CONTEXT);
+	~EGLWindow();
+
+	EGLWindow(const EGLWindow &) = delete;
+	EGLWindow &operator=(const EGLWindow &) = delete;
+
+	// Make our context current on the calling thread, drawing to the window,
+	// creating its surface if it was released
+	void make_current();
+
+	// Make our context current on the calling thread without a surface
+	// (EGL_KHR_surfaceless_context), returns false if the driver can't
+	bool make_current_surfaceless();
+
+	// Unbind our context from the calling thread
+	void release_current();
+
+	// Display what was rendered to the window
+	void swap_buffers();
+
+	// How many frames ago the back buffer was displayed (EGL_EXT_buffer_age),
+	// 0 if its content is unknown. Must be called with the window current,
+	// before drawing.
+	int get_buffer_age();
+
+	// Tell the driver only rect (in window coordinates, top to bottom) of the
+	// back buffer will be drawn to (EGL_KHR_partial_update), so it doesn't
+	// have to preserve or resolve the rest. Must be called with the window
+	// current, after get_buffer_age and before drawing.
+	void set_damage_region(const QRect &rect);
+
+	// Display what was rendered to the window, telling the compositor
+	// only rect changed since the last swap
+	// (EGL_KHR_swap_buffers_with_damage), a plain swap if the driver can't
+	void swap_buffers_with_damage(const QRect &rect);
+
+	// Destroy the window surface (but keep the context and everything in it)
+	void release_surface();
+	bool has_surface();
+
+	EGLDisplay get_display();
+	EGLContext get_context() const;
+
+	// Whether the context is a GLES one
+	bool is_gles();
+
+private:
+	// Create the context for an API, returns false if the driver can't
+	bool create_context(EGLenum api, EGLContext share_context);
+
+	void create_surface();
+
+	// Convert a rect in window coordinates to an EGL one, which starts from
+	// the bottom left
+	void to_egl_rect(const QRect &rect, EGLint *egl_rect);
+
+	// Free everything, used by the destructor and when the constructor fails
+	// halfway
+	void cleanup();
+
+	// The display is caps', which keeps it initialized
+	const EGLCapabilities *caps;
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	EGLenum egl_api = EGL_OPENGL_API;
+	EGLConfig egl_config = EGL_NO_CONFIG_KHR;
+	EGLContext egl_context = EGL_NO_CONTEXT;
+	int window_id;
+	EGLSurface egl_surface = EGL_NO_SURFACE;
+};
+
+// This is the EGL state for a window, if DMA-BUF is enabled, this will keep
 // a reference to the pixmap used by the X server to maintain the screen state,
 // so it can be displayed without having to copy the data from the GPU and back.
+// The window shows the part of the pixmap at its geometry.
+//
+// Each monitor's window has its own EGLState, with its own context and
+// surface, so each is drawn by its own thread and swaps at its own monitor's
+// vblank, and no surface is bigger than its monitor. The pixmap is imported
+// only once: the first EGLState imports it into a texture, and the others
+// share that texture (and the EGLImage behind it) through their contexts.
+//
+// The EGLStates live as long as the session: when DMA-BUF is disabled they're
+// only unbound from their image and give up their surfaces, and the first one
+// keeps the images it imported in a small pool, keyed by the identity of
+// their buffer. Enabling DMA-BUF again (after a reconnect, or when xorgxrdp
+// sends a pixmap it sent before) then only binds the pooled texture again,
+// instead of creating contexts and importing the pixmap from scratch.
+//
+// When the kernel and the driver allow it, we synchronize with the X server's
+// rendering into the pixmap explicitly: we take the fences of its pending
+// writes from the DMA-BUF (DMA_BUF_IOCTL_EXPORT_SYNC_FILE) and make the GPU
+// wait for them before sampling (EGL_ANDROID_native_fence_sync), so the CPU
+// never blocks on them and we never sample a half rendered frame, whatever
+// the driver's implicit synchronization does. Otherwise we rely on the latter.
+//
+// Only the part of the window that changed is redrawn and presented: the
+// draws are scissored to what changed since the back buffer was last shown
+// (from its buffer age and the damage of the frames since), and the swaps tell
+// the X server what changed, so an idle desktop with a ticking clock doesn't
+// cost a full screen of GPU and compositor work every frame.
 class EGLState {
 public:
+	// geometry is the part of the pixmap the window shows
+	// share is the EGLState of another monitor whose pixmap texture we show,
+	// or null to import the pixmap ourselves. It must outlive us, and so
+	// must caps.
+	// Throws std::runtime_error if the context can't be created
 	EGLState(
-		const char *x11_display,
+		const EGLCapabilities *caps,
 		int window_id,
-		int fd,
-		uint32_t width,
-		uint32_t height,
-		uint16_t stride,
-		uint32_t size,
-		uint32_t format
+		const QRect &geometry,
+		const EGLState *share = nullptr
 	);
 	~EGLState();
 
-	// Render the shared texture to the screen
-	void render();
+	// Start showing a DMA-BUF image (creating the surface if unbind released
+	// it), from the pool if it was imported before. When sharing, this must
+	// be called after the EGLState we share with is bound to the image.
+	// Throws std::runtime_error if the image can't be imported
+	void bind(const struct dma_buf_image &image);
 
-	// Check if EGL is supported on the given display
-	static bool is_supported(const char *x11_display);
+	// Stop showing the image and release the surface, so a presenter can use
+	// the window. The context and the pool stay.
+	void unbind();
+
+	// Render the window's part of the texture, damage is what changed in the
+	// pixmap since the last render, or null if that's unknown. Does nothing
+	// when unbound.
+	void render(const std::vector<QRect> *damage = nullptr);
 
 private:
-	// Import a DMA-BUF image reference into our EGL state using
-	// EGL_EXT_image_dma_buf_import
-	void import_dma_buf_fd(int fd,
-		uint32_t width,
-		uint32_t height,
-		uint16_t stride,
-		uint32_t size,
-		uint32_t format
-	);
+	// An imported DMA-BUF image, identified by the buffers of its planes
+	// (their DMA-BUF's device and inode, which are the same however often
+	// the buffer is exported) and its layout
+	struct pooled_image {
+		dev_t devices[DMA_BUF_MAX_PLANES];
+		ino_t inodes[DMA_BUF_MAX_PLANES];
+		struct dma_buf_image image;
+		EGLImageKHR egl_image;
+		GLuint texture;
+		uint64_t last_used;
+	};
+
+	// Get the identity of an image's buffers
+	// Throws std::runtime_error if a plane's fd isn't valid
+	static struct pooled_image identify_image(const struct dma_buf_image &image);
+	static bool is_same_image(const struct pooled_image &a, const struct pooled_image &b);
+
+	// Get the texture of an image from the pool, importing it if it isn't
+	// there, and evicting the least recently used other image if the pool is
+	// full
+	GLuint get_pooled_texture(const struct dma_buf_image &image);
+
+	// Import a DMA-BUF image into entry's EGLImage and texture using
+	// EGL_EXT_image_dma_buf_import, and its modifier using
+	// EGL_EXT_image_dma_buf_import_modifiers
+	void import_dma_buf(const struct dma_buf_image &image, struct pooled_image &entry);
+
+	// Free a pooled image's EGLImage, and its texture if the context is
+	// current
+	void free_pooled_image(struct pooled_image &entry, bool current);
+
+	// Check for what explicit synchronization needs, sets explicit_sync
+	void setup_explicit_sync(int fd);
+
+	// Drop our reference to the pixmap's DMA-BUF and its pending fences
+	void release_pixmap_sync();
+
+	// Make the GPU wait for the X server's pending writes to the pixmap,
+	// must be called with the context current before drawing
+	void wait_for_pixmap();
+
+	// Count how long the GPU waited for the last frame that was still being
+	// rendered, once its fences have signaled
+	void account_pixmap_wait();
 
-	// Set up global GL state AFTER loading the shared pixmap
-	void setup_gl_state();
+	// Limit drawing to rect (in window coordinates), or lift the limit if
+	// it's the whole window
+	void setup_scissor(const QRect &rect);
+
+	// Free the renderer and the pool, used by the destructor and when the
+	// constructor fails halfway
+	void cleanup();
 
 	// EGL state
-	EGLDisplay egl_display = EGL_NO_DISPLAY;
-	EGLConfig egl_config = EGL_NO_CONFIG_KHR;
-	EGLContext egl_context = EGL_NO_CONTEXT;
-	EGLSurface egl_surface = EGL_NO_SURFACE;
-	EGLImageKHR egl_image = EGL_NO_IMAGE_KHR;
+	const EGLCapabilities *caps;
+	const EGLState *share;
+	EGLWindow window;
+
+	// The texture of the image we show, ours (from the pool) or the one of
+	// the EGLState we share with, and whether we're bound to it
 	GLuint texture = 0;
+	bool bound = false;
+
+	// The images we imported, if we don't share, and a counter to find the
+	// least recently used
+	std::vector<struct pooled_image> image_pool;
+	uint64_t pool_clock = 0;
+
+	// Draws the pixmap's texture
+	GLRenderer *renderer = nullptr;
+
+	// Our own reference to the pixmap's DMA-BUF, to export its fences, and
+	// whether we synchronize explicitly
+	int dma_buf_fd = -1;
+	bool explicit_sync = false;
+
+	// Whether the kernel can export DMA-BUF fences, probed on the first bind
+	bool fences_probed = false;
+	bool kernel_fences = false;
+
+	// The fences of the last frame that was still being rendered when we
+	// drew it, and when we drew it (CLOCK_MONOTONIC, like fence timestamps)
+	int pending_fence_fd = -1;
+	uint64_t pending_since_ns = 0;
+
+	// Frames the X server was still rendering when we drew them, and how
+	// long the GPU waited for them
+	StatCounter rendering_frames;
+	StatCounter rendering_wait;
+
+	// The part of the pixmap the window shows
+	QRect geometry;
+
+	// What changed in the window in its last frames, to know what's stale in
+	// a back buffer from its age
+	DamageHistory damage_history;
+	bool scissor_enabled = false;
 
-	// The size of the shared pixmap
-	int width;
-	int height;
+	// The size of the pixmap
+	int width = 0;
+	int height = 0;
 };
 
 #endif
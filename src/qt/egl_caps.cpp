@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+#include "egl_caps.h"
+
+bool has_extension(const char *extensions, const char *name) {
+	size_t length = strlen(name);
+	for (const char *found = strstr(extensions, name); found != nullptr; found = strstr(found + length, name)) {
+		bool starts = found == extensions || found[-1] == ' ';
+		bool ends = found[length] == '\0' || found[length] == ' ';
+		if (starts && ends) {
+			return true;
+		}
+	}
+	return false;
+}
+
+template <typename T>
+static T lookup(const char *name) {
+	return reinterpret_cast<T>(eglGetProcAddress(name));
+}
+
+EGLCapabilities::EGLCapabilities(const char *x11_display) {
+	if (x11_display == nullptr || x11_display[0] != ':') {
+		throw std::runtime_error("EGL isn't supported on remote X11 displays");
+	}
+
+	intptr_t x11_display_num = atoi(&x11_display[1]);
+	display = eglGetDisplay(reinterpret_cast<EGLNativeDisplayType>(x11_display_num));
+	if (display == EGL_NO_DISPLAY) {
+		throw std::runtime_error("eglGetDisplay failed");
+	}
+	if (eglInitialize(display, nullptr, nullptr) == EGL_FALSE) {
+		eglTerminate(display);
+		display = EGL_NO_DISPLAY;
+		throw std::runtime_error("eglInitialize failed");
+	}
+
+	const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (extensions == nullptr) {
+		extensions = "";
+	}
+
+	egl_create_image = lookup<PFNEGLCREATEIMAGEKHRPROC>("eglCreateImageKHR");
+	egl_destroy_image = lookup<PFNEGLDESTROYIMAGEKHRPROC>("eglDestroyImageKHR");
+	gl_image_target_texture_2d = lookup<PFNGLEGLIMAGETARGETTEXTURE2DOESPROC>("glEGLImageTargetTexture2DOES");
+	dma_buf_import = has_extension(extensions, "EGL_EXT_image_dma_buf_import") &&
+		egl_create_image != nullptr && egl_destroy_image != nullptr && gl_image_target_texture_2d != nullptr;
+
+	dma_buf_modifiers = dma_buf_import && has_extension(extensions, "EGL_EXT_image_dma_buf_import_modifiers");
+	if (dma_buf_modifiers) {
+		query_dma_buf_formats();
+	}
+
+	if (has_extension(extensions, "EGL_ANDROID_native_fence_sync") && has_extension(extensions, "EGL_KHR_wait_sync")) {
+		egl_create_sync = lookup<PFNEGLCREATESYNCKHRPROC>("eglCreateSyncKHR");
+		egl_wait_sync = lookup<PFNEGLWAITSYNCKHRPROC>("eglWaitSyncKHR");
+		egl_destroy_sync = lookup<PFNEGLDESTROYSYNCKHRPROC>("eglDestroySyncKHR");
+		native_fence_sync = egl_create_sync != nullptr && egl_wait_sync != nullptr && egl_destroy_sync != nullptr;
+	}
+	if (dma_buf_import && !native_fence_sync) {
+		log(LOG_INFO, "EGL can't wait for native fences, DMA-BUF will rely on implicit synchronization.\n");
+	}
+
+	surfaceless_context = has_extension(extensions, "EGL_KHR_surfaceless_context");
+
+	buffer_age = has_extension(extensions, "EGL_EXT_buffer_age") || has_extension(extensions, "EGL_KHR_partial_update");
+	if (has_extension(extensions, "EGL_KHR_partial_update")) {
+		egl_set_damage_region = lookup<PFNEGLSETDAMAGEREGIONKHRPROC>("eglSetDamageRegionKHR");
+	}
+	// The EXT version came first and has the same signature
+	if (has_extension(extensions, "EGL_KHR_swap_buffers_with_damage")) {
+		egl_swap_buffers_with_damage = lookup<PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC>("eglSwapBuffersWithDamageKHR");
+	} else if (has_extension(extensions, "EGL_EXT_swap_buffers_with_damage")) {
+		egl_swap_buffers_with_damage = lookup<PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC>("eglSwapBuffersWithDamageEXT");
+	}
+
+	log(LOG_DEBUG, "EGL on %s: DMA-BUF import %s (%s modifiers, %zu formats), native fences %s, buffer age %s, partial update %s, swap with damage %s\n",
+		x11_display,
+		dma_buf_import ? "yes" : "no",
+		dma_buf_modifiers ? "with" : "without",
+		dma_buf_formats.size(),
+		native_fence_sync ? "yes" : "no",
+		buffer_age ? "yes" : "no",
+		egl_set_damage_region != nullptr ? "yes" : "no",
+		egl_swap_buffers_with_damage != nullptr ? "yes" : "no");
+}
+
+EGLCapabilities::~EGLCapabilities() {
+	eglTerminate(display);
+}
+
+void EGLCapabilities::query_dma_buf_formats() {
+	PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT = lookup<PFNEGLQUERYDMABUFFORMATSEXTPROC>("eglQueryDmaBufFormatsEXT");
+	PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT = lookup<PFNEGLQUERYDMABUFMODIFIERSEXTPROC>("eglQueryDmaBufModifiersEXT");
+	if (eglQueryDmaBufFormatsEXT == nullptr || eglQueryDmaBufModifiersEXT == nullptr) {
+		return;
+	}
+
+	EGLint num_formats = 0;
+	if (eglQueryDmaBufFormatsEXT(display, 0, nullptr, &num_formats) == EGL_FALSE) {
+		return;
+	}
+	std::vector<EGLint> fourccs(num_formats);
+	eglQueryDmaBufFormatsEXT(display, num_formats, fourccs.data(), &num_formats);
+	for (EGLint fourcc : fourccs) {
+		EGLint num_modifiers = 0;
+		if (eglQueryDmaBufModifiersEXT(display, fourcc, 0, nullptr, nullptr, &num_modifiers) == EGL_FALSE || num_modifiers == 0) {
+			continue;
+		}
+		std::vector<EGLuint64KHR> modifiers(num_modifiers);
+		std::vector<EGLBoolean> external_only(num_modifiers);
+		eglQueryDmaBufModifiersEXT(display, fourcc, num_modifiers, modifiers.data(), external_only.data(), &num_modifiers);
+		int usable = 0;
+		for (EGLint i = 0; i < num_modifiers; i++) {
+			// We sample the image as a GL_TEXTURE_2D, which external only
+			// layouts can't be bound to
+			if (external_only[i]) {
+				continue;
+			}
+			dma_buf_formats.push_back({ .format = static_cast<uint32_t>(fourcc), .modifier = modifiers[i] });
+			usable++;
+		}
+		log(LOG_DEBUG, "DMA-BUF format %.4s: %d modifiers, %d usable\n", reinterpret_cast<const char *>(&fourcc), num_modifiers, usable);
+	}
+}
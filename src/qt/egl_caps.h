@@ -0,0 +1,79 @@
+#ifndef QT_EGL_CAPS_H
+#define QT_EGL_CAPS_H
+
+#define USE_X11
+#include <GL/gl.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstdint>
+#include <vector>
+
+// A format and modifier pair we can import
+struct dma_buf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+// Whether a space separated extension list (EGL's or GL's) has an extension,
+// which may be the prefix of another one (like EGL_EXT_image_dma_buf_import)
+bool has_extension(const char *extensions, const char *name);
+
+// What EGL can do on the display, probed once at startup.
+// It keeps the display initialized for as long as it exists, so DMA-BUF
+// activations (at login, and after every reconnect) and the GL presenters
+// don't initialize and terminate it again, and it looks up every extension
+// entry point and the importable DMA-BUF formats once. Entry points of
+// extensions the display doesn't have are left null.
+// It isn't modified after it's created, so it can be used from any thread.
+class EGLCapabilities {
+public:
+	// Throws std::runtime_error if EGL can't be used on the display
+	EGLCapabilities(const char *x11_display);
+	~EGLCapabilities();
+
+	EGLCapabilities(const EGLCapabilities &) = delete;
+	EGLCapabilities &operator=(const EGLCapabilities &) = delete;
+
+	EGLDisplay display = EGL_NO_DISPLAY;
+
+	// DMA-BUF images can be imported and bound to a texture
+	// (EGL_EXT_image_dma_buf_import, EGL_KHR_image_base and
+	// GL_OES_EGL_image)
+	bool dma_buf_import = false;
+	PFNEGLCREATEIMAGEKHRPROC egl_create_image = nullptr;
+	PFNEGLDESTROYIMAGEKHRPROC egl_destroy_image = nullptr;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC gl_image_target_texture_2d = nullptr;
+
+	// DMA-BUF images can have an explicit modifier
+	// (EGL_EXT_image_dma_buf_import_modifiers), and the format and modifier
+	// pairs that can be imported into a GL_TEXTURE_2D (empty if the driver
+	// can't tell, in which case only images with an implicit layout can be
+	// imported)
+	bool dma_buf_modifiers = false;
+	std::vector<struct dma_buf_format> dma_buf_formats;
+
+	// The GPU can be made to wait for native fences
+	// (EGL_ANDROID_native_fence_sync and EGL_KHR_wait_sync)
+	bool native_fence_sync = false;
+	PFNEGLCREATESYNCKHRPROC egl_create_sync = nullptr;
+	PFNEGLWAITSYNCKHRPROC egl_wait_sync = nullptr;
+	PFNEGLDESTROYSYNCKHRPROC egl_destroy_sync = nullptr;
+
+	// A context can be made current without a surface
+	// (EGL_KHR_surfaceless_context)
+	bool surfaceless_context = false;
+
+	// The damage extensions: EGL_EXT_buffer_age (which
+	// EGL_KHR_partial_update defines too), EGL_KHR_partial_update and
+	// EGL_KHR/EXT_swap_buffers_with_damage
+	bool buffer_age = false;
+	PFNEGLSETDAMAGEREGIONKHRPROC egl_set_damage_region = nullptr;
+	PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC egl_swap_buffers_with_damage = nullptr;
+
+private:
+	// Get the format and modifier pairs the driver can import into a
+	// GL_TEXTURE_2D
+	void query_dma_buf_formats();
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdexcept>
+
+#include "common.h"
+#include "egl_thread.h"
+
+EGLRenderThread::present_request EGLRenderThread::wake_request;
+EGLRenderThread::present_request EGLRenderThread::stop_request;
+
+bool EGLRenderThread::is_real_request(present_request *request) {
+	return request != nullptr && request != &wake_request && request != &stop_request;
+}
+
+EGLRenderThread::EGLRenderThread(const EGLCapabilities *caps, int window_id, const QRect &geometry, const EGLRenderThread *share) :
+	mailbox(nullptr),
+	merged_requests("DMA-BUF paints merged into the next one", "paints", STATS_LOG_EVERY)
+{
+	// The context is current on the thread that creates it, so that's the
+	// render thread, which needs the arguments only until it's created
+	std::promise<void> created;
+	std::future<void> created_future = created.get_future();
+	thread = std::thread(&EGLRenderThread::thread_func, this, caps, window_id, std::cref(geometry), share != nullptr ? share->egl : nullptr, std::ref(created));
+	try {
+		created_future.get();
+	} catch (...) {
+		thread.join();
+		throw;
+	}
+}
+
+EGLRenderThread::~EGLRenderThread() {
+	present_request *pending = mailbox.exchange(&stop_request, std::memory_order_acq_rel);
+	if (is_real_request(pending)) {
+		delete pending;
+	}
+	mailbox.notify_one();
+	thread.join();
+}
+
+void EGLRenderThread::bind(const struct dma_buf_image &image) {
+	run_task([this, &image]() { egl->bind(image); });
+}
+
+void EGLRenderThread::unbind() {
+	run_task([this]() { egl->unbind(); });
+}
+
+void EGLRenderThread::run_task(std::function<void()> task) {
+	std::promise<void> done;
+	std::future<void> done_future = done.get_future();
+	{
+		std::lock_guard<std::mutex> lock(tasks_mutex);
+		tasks.push_back([&task, &done]() {
+			try {
+				task();
+			} catch (...) {
+				done.set_exception(std::current_exception());
+				return;
+			}
+			done.set_value();
+		});
+	}
+	// If there's a request in the mailbox already, the render thread runs
+	// the tasks when it takes it
+	present_request *expected = nullptr;
+	if (mailbox.compare_exchange_strong(expected, &wake_request, std::memory_order_acq_rel)) {
+		mailbox.notify_one();
+	}
+	// Rethrows what the task threw
+	done_future.get();
+}
+
+void EGLRenderThread::run_tasks() {
+	std::vector<std::function<void()>> pending;
+	{
+		std::lock_guard<std::mutex> lock(tasks_mutex);
+		pending.swap(tasks);
+	}
+	for (std::function<void()> &task : pending) {
+		task();
+	}
+}
+
+void EGLRenderThread::present(const std::vector<QRect> *damage) {
+	present_request *request = new present_request { .full = damage == nullptr, .damage = {} };
+	if (damage != nullptr) {
+		request->damage = *damage;
+	}
+
+	// If the render thread didn't take the previous request, take ours back
+	// and post the two merged. If it took ours in the meantime, post the
+	// previous one on its own, drawing what ours did again is harmless.
+	bool merged = false;
+	for (;;) {
+		present_request *previous = mailbox.exchange(request, std::memory_order_acq_rel);
+		if (!is_real_request(previous)) {
+			// The render thread runs the tasks a wake request was for when
+			// it takes ours
+			break;
+		}
+		merged = true;
+		present_request *ours = mailbox.exchange(nullptr, std::memory_order_acq_rel);
+		if (ours == nullptr) {
+			request = previous;
+			continue;
+		}
+		if (previous->full) {
+			ours->full = true;
+			ours->damage.clear();
+		} else if (!ours->full) {
+			ours->damage.insert(ours->damage.end(), previous->damage.begin(), previous->damage.end());
+		}
+		delete previous;
+		request = ours;
+	}
+	mailbox.notify_one();
+	merged_requests.add(merged ? 1 : 0);
+}
+
+void EGLRenderThread::thread_func(const EGLCapabilities *caps, int window_id, const QRect &geometry, const EGLState *share, std::promise<void> &created) {
+	try {
+		egl = new EGLState(caps, window_id, geometry, share);
+	} catch (...) {
+		created.set_exception(std::current_exception());
+		return;
+	}
+	created.set_value();
+
+	for (;;) {
+		mailbox.wait(nullptr, std::memory_order_acquire);
+		present_request *request = mailbox.exchange(nullptr, std::memory_order_acq_rel);
+		run_tasks();
+		if (request == &stop_request) {
+			break;
+		}
+		if (!is_real_request(request)) {
+			continue;
+		}
+
+		try {
+			egl->render(request->full ? nullptr : &request->damage);
+		} catch (const std::exception &e) {
+			log(LOG_ERROR, "EGLRenderThread: rendering failed: %s\n", e.what());
+		}
+		delete request;
+	}
+
+	// The context has to be released by the thread it's current on
+	delete egl;
+	egl = nullptr;
+}
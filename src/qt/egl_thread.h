@@ -0,0 +1,104 @@
+#ifndef QT_EGL_THREAD_H
+#define QT_EGL_THREAD_H
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <QRect>
+
+#include "egl.h"
+#include "stats.h"
+
+// Displays the DMA-BUF pixmap on a monitor's window from a thread of its own,
+// which owns the window's EGLState and its context. There's one per monitor,
+// so a monitor waiting for its vblank doesn't hold up the others, and it
+// lives as long as the session, so DMA-BUF can be enabled again without
+// creating a context.
+// Painting the pixmap used to happen on the xup client thread, so a swap
+// blocked on vblank (or on a busy GPU) held up reading the socket and
+// forwarding input. Now the xup client thread only posts a present request to
+// a single slot mailbox and returns: the render thread takes the latest
+// request, and requests it didn't get to in time are merged into the next
+// one, so it never falls behind by more than one frame.
+// Posting never takes a lock or waits for the render thread.
+class EGLRenderThread {
+public:
+	// Create the EGLState on the render thread, waits until it's created
+	// share is the render thread of another monitor whose pixmap texture we
+	// show (it must outlive us), or null to import the pixmap
+	// Throws what the EGLState constructor throws
+	EGLRenderThread(
+		const EGLCapabilities *caps,
+		int window_id,
+		const QRect &geometry,
+		const EGLRenderThread *share
+	);
+	// Waits for the request being drawn, drops the others, and destroys the
+	// EGLState on the render thread
+	~EGLRenderThread();
+
+	EGLRenderThread(const EGLRenderThread &) = delete;
+	EGLRenderThread &operator=(const EGLRenderThread &) = delete;
+
+	// Bind the EGLState to an image, or unbind it (see EGLState::bind and
+	// unbind), waiting until it's done. When sharing, the render thread we
+	// share with has to be bound first.
+	// bind throws what EGLState::bind throws
+	void bind(const struct dma_buf_image &image);
+	void unbind();
+
+	// Ask for the pixmap to be displayed, damage is what changed in it since
+	// the last request (in session coordinates), or null if that's unknown
+	// Must be called from the thread that destroys us
+	void present(const std::vector<QRect> *damage);
+
+private:
+	// What changed since the last present, everything if full is set
+	struct present_request {
+		bool full;
+		std::vector<QRect> damage;
+	};
+
+	void thread_func(
+		const EGLCapabilities *caps,
+		int window_id,
+		const QRect &geometry,
+		const EGLState *share,
+		std::promise<void> &created
+	);
+
+	// Run a function on the render thread and wait for it, rethrowing what
+	// it throws
+	void run_task(std::function<void()> task);
+
+	// Run the tasks queued by run_task, on the render thread
+	void run_tasks();
+
+	// The request the render thread hasn't taken yet, if any, wake_request
+	// if it only has tasks to run, or stop_request once we're stopping
+	std::atomic<present_request *> mailbox;
+	static present_request wake_request;
+	static present_request stop_request;
+
+	// Whether a mailbox value is a request of its own, which whoever takes
+	// it frees
+	static bool is_real_request(present_request *request);
+
+	// Tasks for the render thread, which are rare enough to take a lock
+	std::mutex tasks_mutex;
+	std::vector<std::function<void()>> tasks;
+
+	// Only used by the render thread, once it's created (which the
+	// constructor waits for), other render threads may share its texture
+	EGLState *egl = nullptr;
+
+	std::thread thread;
+
+	// Requests merged into a later one before the render thread got to them
+	StatCounter merged_requests;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "common.h"
+#include "frame.h"
+
+Frame::Frame(int x, int y, int width, int height, unsigned char *data, int num_rects, xrdp_rect_spec *rects, std::shared_ptr<void> buffer, std::function<void()> release) : buffer(std::move(buffer)), rects(rects, rects + num_rects)
+{
+	this->x = x;
+	this->y = y;
+	this->width = width;
+	this->height = height;
+	this->data = data;
+	this->release = release;
+}
+
+Frame::~Frame()
+{
+	acknowledge();
+	if (retire) {
+		retire();
+	}
+}
+
+void Frame::acknowledge()
+{
+	if (release) {
+		release();
+		release = nullptr;
+	}
+}
+
+void Frame::set_retire(std::function<void()> retire)
+{
+	this->retire = retire;
+}
+
+unsigned char *Frame::get_data()
+{
+	return data;
+}
+
+const std::vector<xrdp_rect_spec> &Frame::get_rects()
+{
+	return rects;
+}
+
+int Frame::get_x()
+{
+	return x;
+}
+
+int Frame::get_y()
+{
+	return y;
+}
+
+int Frame::get_width()
+{
+	return width;
+}
+
+int Frame::get_height()
+{
+	return height;
+}
+
+std::shared_ptr<void> Frame::get_buffer()
+{
+	return buffer;
+}
+
+FrameQueue::FrameQueue(size_t capacity)
+{
+	this->capacity = capacity;
+}
+
+void FrameQueue::push(std::shared_ptr<Frame> frame)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (frames.size() >= capacity && !closed) {
+		log(LOG_WARN, "Frame queue is full, waiting for the Qt thread to catch up.\n");
+		not_full.wait(lock, [this] { return frames.size() < capacity || closed; });
+	}
+	if (closed) {
+		// The frame is released by our caller once we return
+		return;
+	}
+	frames.push_back(std::move(frame));
+	not_empty.notify_one();
+}
+
+std::shared_ptr<Frame> FrameQueue::pop()
+{
+	std::shared_ptr<Frame> frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (frames.empty()) {
+			return nullptr;
+		}
+		frame = std::move(frames.front());
+		frames.pop_front();
+	}
+	not_full.notify_one();
+	return frame;
+}
+
+bool FrameQueue::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	not_empty.wait(lock, [this] { return !frames.empty() || woken || closed; });
+	woken = false;
+	return !closed;
+}
+
+void FrameQueue::wake()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		woken = true;
+	}
+	not_empty.notify_one();
+}
+
+void FrameQueue::close()
+{
+	std::deque<std::shared_ptr<Frame>> dropped;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		dropped.swap(frames);
+	}
+	not_full.notify_all();
+	not_empty.notify_all();
+}
@@ -0,0 +1,102 @@
+#ifndef QT_FRAME_H
+#define QT_FRAME_H
+
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "info.h"
+
+// A single frame received from xorgxrdp, handed from the xup client thread to
+// the Qt thread.
+// The capture buffer the frame points to belongs to xorgxrdp, which won't touch
+// it again until the frame is acknowledged, so the frame is acknowledged (by
+// calling the release function) only when the frame is destroyed, or when its
+// pixels have been copied out and acknowledge is called. Frames are passed
+// around using std::shared_ptr so the last user releases it.
+class Frame {
+public:
+	// These are the raw values from the xup client thread, the rects are copied
+	// since libxup reuses their buffer for the next message
+	// buffer keeps the memory data points to valid (it may be null), and can
+	// be held past the frame's release by presenters that read from the
+	// capture buffer.
+	Frame(int x, int y, int width, int height, unsigned char *data, int num_rects, xrdp_rect_spec *rects, std::shared_ptr<void> buffer, std::function<void()> release);
+
+	// Calls the release function (unless acknowledge already did) and the
+	// retire function
+	~Frame();
+
+	// Call the release function now, once the frame's pixels have been
+	// staged and the capture buffer isn't needed anymore
+	void acknowledge();
+
+	// Set a function to call when the frame is destroyed, after it's released
+	void set_retire(std::function<void()> retire);
+
+	Frame(const Frame &) = delete;
+	Frame &operator=(const Frame &) = delete;
+
+	// Getters
+	unsigned char *get_data();
+	const std::vector<xrdp_rect_spec> &get_rects();
+	int get_x();
+	int get_y();
+	int get_width();
+	int get_height();
+	std::shared_ptr<void> get_buffer();
+
+private:
+	unsigned char *data;
+	std::shared_ptr<void> buffer;
+	std::vector<xrdp_rect_spec> rects;
+	int x;
+	int y;
+	int width;
+	int height;
+
+	// Called when the capture buffer is no longer needed
+	std::function<void()> release;
+	std::function<void()> retire;
+};
+
+// A bounded queue of frames waiting to be painted by a window
+// The xup client thread pushes frames and returns immediately, the window's
+// render thread (or the Qt thread) pops them on its own schedule.
+class FrameQueue {
+public:
+	FrameQueue(size_t capacity);
+
+	// Add a frame to the queue, blocks only if the queue is full (which
+	// shouldn't happen as xorgxrdp doesn't send frames before the previous
+	// ones are acknowledged).
+	// Frames pushed after close are dropped (and so released immediately).
+	void push(std::shared_ptr<Frame> frame);
+
+	// Take the oldest frame from the queue, or nullptr if the queue is empty
+	std::shared_ptr<Frame> pop();
+
+	// Wait until a frame is pushed or wake is called, returns false once the
+	// queue is closed
+	bool wait();
+
+	// Make wait return even though no frame was pushed
+	void wake();
+
+	// Drop all queued frames and stop accepting new ones
+	void close();
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<std::shared_ptr<Frame>> frames;
+	size_t capacity;
+	bool closed = false;
+	bool woken = false;
+};
+
+#endif
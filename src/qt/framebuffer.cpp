@@ -0,0 +1,89 @@
+#include <cstdint>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "framebuffer.h"
+
+// What the QImage's cleanup function needs to unmap the framebuffer
+struct framebuffer_mapping {
+	void *addr;
+	size_t size;
+};
+
+static void free_framebuffer(void *info) {
+	framebuffer_mapping *mapping = static_cast<framebuffer_mapping *>(info);
+	munmap(mapping->addr, mapping->size);
+	delete mapping;
+}
+
+static size_t round_up(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+QImage::Format qimage_format(enum pixel_format format) {
+	return format == PIXEL_FORMAT_RGB565 ? QImage::Format_RGB16 : QImage::Format_RGB32;
+}
+
+size_t framebuffer_stride(int width, enum pixel_format format) {
+	return round_up(static_cast<size_t>(width) * pixel_format_bytes(format), FRAMEBUFFER_ROW_ALIGNMENT);
+}
+
+void prepare_framebuffer_memory(void *addr, size_t size) {
+	if (size >= FRAMEBUFFER_HUGE_PAGE_SIZE) {
+		// This fails if transparent huge pages are disabled, which is fine
+		if (madvise(addr, size, MADV_HUGEPAGE) != 0) {
+			log(LOG_DEBUG, "Transparent huge pages aren't available for the framebuffer\n");
+		}
+	}
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	// Older kernels, fault the pages in by writing to them. The memory is
+	// fresh, so it's all zeroes anyway.
+	size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	volatile uint8_t *bytes = static_cast<volatile uint8_t *>(addr);
+	for (size_t offset = 0; offset < size; offset += page_size) {
+		bytes[offset] = 0;
+	}
+}
+
+QImage alloc_framebuffer(int width, int height, enum pixel_format format) {
+	size_t stride = framebuffer_stride(width, format);
+	size_t size = stride * height;
+	bool huge = size >= FRAMEBUFFER_HUGE_PAGE_SIZE;
+	size_t alignment = huge ? FRAMEBUFFER_HUGE_PAGE_SIZE : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size = round_up(size, alignment);
+
+	// Huge pages can only back aligned memory, so map a huge page more than
+	// needed and trim the ends
+	size_t mapped_size = huge ? size + alignment : size;
+	void *mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) {
+		throw std::runtime_error("can't map memory for the framebuffer");
+	}
+	uint8_t *addr = static_cast<uint8_t *>(mapped);
+	if (huge) {
+		uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+		size_t head = round_up(start, alignment) - start;
+		size_t tail = mapped_size - head - size;
+		if (head > 0) {
+			munmap(mapped, head);
+		}
+		if (tail > 0) {
+			munmap(addr + head + size, tail);
+		}
+		addr += head;
+	}
+
+	// Anonymous memory is zeroed, which is black in every format we use
+	prepare_framebuffer_memory(addr, size);
+	log(LOG_DEBUG, "Allocated a %dx%d framebuffer, %zu bytes with a stride of %zu%s\n", width, height, size, stride, huge ? ", on huge pages" : "");
+
+	framebuffer_mapping *mapping = new framebuffer_mapping { .addr = addr, .size = size };
+	return QImage(addr, width, height, static_cast<qsizetype>(stride), qimage_format(format), free_framebuffer, mapping);
+}
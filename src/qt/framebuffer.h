@@ -0,0 +1,40 @@
+#ifndef QT_FRAMEBUFFER_H
+#define QT_FRAMEBUFFER_H
+
+// Framebuffer allocation
+// Framebuffers are big (tens of MB for a 4K screen) and are written a whole
+// screen at a time, so they're allocated with rows aligned for the SIMD copy
+// kernels, backed by transparent huge pages when they're big enough (a
+// full-screen copy then takes a handful of TLB misses instead of thousands),
+// and prefaulted when they're allocated, so the first frame after login
+// doesn't take a page fault for every 4 KB it touches.
+
+#include <QImage>
+#include <cstddef>
+
+#include "blit.h"
+
+// Rows start on a cache line, which is also what AVX2 stores want
+#define FRAMEBUFFER_ROW_ALIGNMENT 64
+
+// The size of a transparent huge page (on x86-64, and on aarch64 with 4 KB
+// pages), framebuffers at least this big are backed by them
+#define FRAMEBUFFER_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The QImage format with the same layout as a pixel format
+QImage::Format qimage_format(enum pixel_format format);
+
+// The stride (in bytes) of a framebuffer row of width pixels, aligned to
+// FRAMEBUFFER_ROW_ALIGNMENT
+size_t framebuffer_stride(int width, enum pixel_format format);
+
+// Allocate a black framebuffer, wrapped in a QImage without copying. The
+// memory is freed when the last copy of the QImage is destroyed.
+// Throws std::runtime_error if the memory can't be allocated
+QImage alloc_framebuffer(int width, int height, enum pixel_format format);
+
+// Ask for huge pages for memory that's already mapped (like a shared memory
+// segment), if it's big enough, and prefault it
+void prepare_framebuffer_memory(void *addr, size_t size);
+
+#endif
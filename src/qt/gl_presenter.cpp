@@ -0,0 +1,286 @@
+#include <stdexcept>
+
+#include "common.h"
+#include "blit.h"
+#include "egl_caps.h"
+#include "gl_presenter.h"
+
+// How long to wait for the GPU to finish reading an upload segment before
+// giving up on it (in nanoseconds)
+#define GL_PRESENTER_FENCE_TIMEOUT 1000000000
+
+GLPresenter::GLPresenter(const EGLCapabilities *caps, WId window_id, const QRect &geometry, enum pixel_format capture_format) {
+	this->geometry = geometry;
+	bytes_per_pixel = pixel_format_bytes(capture_format);
+	if (capture_format == PIXEL_FORMAT_RGB565) {
+		upload_format = GL_RGB;
+		upload_type = GL_UNSIGNED_SHORT_5_6_5;
+	} else {
+		upload_format = GL_BGRA;
+		upload_type = GL_UNSIGNED_BYTE;
+	}
+	upload_blit = blit_rect_func_for(capture_format, capture_format);
+
+	if (caps == nullptr) {
+		throw std::runtime_error("EGL isn't available");
+	}
+	window = new EGLWindow(caps, static_cast<int>(window_id));
+
+	try {
+		GLint max_texture_size = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+		if (geometry.width() > max_texture_size || geometry.height() > max_texture_size) {
+			throw std::runtime_error("the monitor is bigger than the maximum texture size");
+		}
+
+		glGenTextures(1, &texture);
+		if (texture == 0) {
+			throw std::runtime_error("glGenTextures failed");
+		}
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, geometry.width(), geometry.height(), 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+		if (glGetError() != GL_NO_ERROR) {
+			throw std::runtime_error("glTexImage2D failed");
+		}
+
+		renderer = new GLRenderer();
+
+		if (setup_upload_buffer()) {
+			log(LOG_DEBUG, "GLPresenter: uploading through a persistently mapped buffer\n");
+		} else {
+			log(LOG_DEBUG, "GLPresenter: persistently mapped buffers aren't supported, uploading directly\n");
+		}
+	} catch (...) {
+		cleanup();
+		throw;
+	}
+
+	glViewport(0, 0, geometry.width(), geometry.height());
+
+	// Rows of 16 bit pixels aren't padded to 4 bytes, neither in the capture
+	// buffer nor when we pack them into the upload buffer
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	// We're used from the window's render thread from now on
+	window->release_current();
+}
+
+GLPresenter::~GLPresenter() {
+	// We're destroyed on another thread than the one we render on, so take
+	// the context back to free what's in it
+	if (window != nullptr) {
+		try {
+			window->make_current();
+		} catch (const std::exception &e) {
+			log(LOG_WARN, "GLPresenter: can't make the context current to clean up (%s)\n", e.what());
+		}
+	}
+	cleanup();
+}
+
+void GLPresenter::cleanup() {
+	if (window == nullptr) {
+		return;
+	}
+
+	for (int i = 0; i < GL_PRESENTER_UPLOAD_SEGMENTS; i++) {
+		if (upload_fences[i] != nullptr) {
+			gl_delete_sync(upload_fences[i]);
+			upload_fences[i] = nullptr;
+		}
+	}
+	if (upload_buffer != 0) {
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+		if (upload_addr != nullptr) {
+			gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+			upload_addr = nullptr;
+		}
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		gl_delete_buffers(1, &upload_buffer);
+		upload_buffer = 0;
+	}
+
+	delete renderer;
+	renderer = nullptr;
+
+	if (texture != 0) {
+		glDeleteTextures(1, &texture);
+		texture = 0;
+	}
+
+	delete window;
+	window = nullptr;
+}
+
+bool GLPresenter::setup_upload_buffer() {
+	const char *extensions = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+	if (extensions == nullptr || !has_extension(extensions, "GL_ARB_buffer_storage") || !has_extension(extensions, "GL_ARB_sync")) {
+		return false;
+	}
+
+	gl_gen_buffers = reinterpret_cast<PFNGLGENBUFFERSPROC>(eglGetProcAddress("glGenBuffers"));
+	gl_delete_buffers = reinterpret_cast<PFNGLDELETEBUFFERSPROC>(eglGetProcAddress("glDeleteBuffers"));
+	gl_bind_buffer = reinterpret_cast<PFNGLBINDBUFFERPROC>(eglGetProcAddress("glBindBuffer"));
+	gl_buffer_storage = reinterpret_cast<PFNGLBUFFERSTORAGEPROC>(eglGetProcAddress("glBufferStorage"));
+	gl_map_buffer_range = reinterpret_cast<PFNGLMAPBUFFERRANGEPROC>(eglGetProcAddress("glMapBufferRange"));
+	gl_unmap_buffer = reinterpret_cast<PFNGLUNMAPBUFFERPROC>(eglGetProcAddress("glUnmapBuffer"));
+	gl_fence_sync = reinterpret_cast<PFNGLFENCESYNCPROC>(eglGetProcAddress("glFenceSync"));
+	gl_client_wait_sync = reinterpret_cast<PFNGLCLIENTWAITSYNCPROC>(eglGetProcAddress("glClientWaitSync"));
+	gl_delete_sync = reinterpret_cast<PFNGLDELETESYNCPROC>(eglGetProcAddress("glDeleteSync"));
+	if (gl_gen_buffers == nullptr || gl_delete_buffers == nullptr || gl_bind_buffer == nullptr ||
+		gl_buffer_storage == nullptr || gl_map_buffer_range == nullptr || gl_unmap_buffer == nullptr ||
+		gl_fence_sync == nullptr || gl_client_wait_sync == nullptr || gl_delete_sync == nullptr) {
+		return false;
+	}
+
+	// The damaged region never covers more than the window, so a segment of
+	// the window's size always fits a whole frame
+	upload_segment_size = static_cast<size_t>(geometry.width()) * geometry.height() * bytes_per_pixel;
+	GLsizeiptr size = static_cast<GLsizeiptr>(upload_segment_size) * GL_PRESENTER_UPLOAD_SEGMENTS;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	gl_gen_buffers(1, &upload_buffer);
+	gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+	gl_buffer_storage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+	upload_addr = static_cast<uint8_t *>(gl_map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+	gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (upload_addr == nullptr) {
+		gl_delete_buffers(1, &upload_buffer);
+		upload_buffer = 0;
+		return false;
+	}
+	return true;
+}
+
+const char *GLPresenter::get_name() {
+	return "gl";
+}
+
+QImage *GLPresenter::get_framebuffer() {
+	return nullptr;
+}
+
+bool GLPresenter::copies_frames() {
+	return false;
+}
+
+void GLPresenter::begin_update(const std::shared_ptr<Frame> &frame) {
+	this->frame = frame;
+}
+
+void GLPresenter::present(const QRegion &region) {
+	if (suspended || frame == nullptr) {
+		frame = nullptr;
+		return;
+	}
+
+	window->make_current();
+
+	if (upload_buffer != 0) {
+		// Wait until the GPU is done with the segment we're about to fill,
+		// which is normally long done since we alternate between them
+		upload_segment = (upload_segment + 1) % GL_PRESENTER_UPLOAD_SEGMENTS;
+		upload_offset = 0;
+		GLsync &fence = upload_fences[upload_segment];
+		if (fence != nullptr) {
+			if (gl_client_wait_sync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_PRESENTER_FENCE_TIMEOUT) == GL_TIMEOUT_EXPIRED) {
+				log(LOG_WARN, "GLPresenter: timed out waiting for an upload to finish\n");
+			}
+			gl_delete_sync(fence);
+			fence = nullptr;
+		}
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+	}
+
+	// The frame must cover the window, which it does unless we're in the
+	// middle of a resize
+	QRegion clipped = region.intersected(QRect(-geometry.topLeft(), QSize(frame->get_width(), frame->get_height()))).intersected(QRect(QPoint(0, 0), geometry.size()));
+	size_t clipped_bytes = 0;
+	for (const QRect &rect : clipped) {
+		clipped_bytes += static_cast<size_t>(rect.width()) * rect.height() * bytes_per_pixel;
+	}
+	for (const QRect &rect : clipped) {
+		upload_rect(rect, clipped_bytes >= BLIT_NON_TEMPORAL_THRESHOLD);
+	}
+
+	if (upload_buffer != 0) {
+		upload_fences[upload_segment] = gl_fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	frame = nullptr;
+
+	draw();
+	count_presented(clipped);
+}
+
+void GLPresenter::upload_rect(const QRect &rect, bool non_temporal) {
+	size_t src_stride = static_cast<size_t>(frame->get_width()) * bytes_per_pixel;
+	const uint8_t *src = frame->get_data() + (geometry.y() + rect.y()) * src_stride + (geometry.x() + rect.x()) * bytes_per_pixel;
+	size_t bytes = static_cast<size_t>(rect.width()) * rect.height() * bytes_per_pixel;
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	if (upload_buffer != 0 && upload_offset + bytes <= upload_segment_size) {
+		// Pack the rect into the upload buffer and upload it from there
+		size_t offset = upload_segment * upload_segment_size + upload_offset;
+		upload_blit(upload_addr + offset, static_cast<size_t>(rect.width()) * bytes_per_pixel, src, src_stride, 0, 0, rect.width(), rect.height(), non_temporal);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glTexSubImage2D(
+			GL_TEXTURE_2D, 0,
+			rect.x(), rect.y(),
+			rect.width(), rect.height(),
+			upload_format, upload_type,
+			reinterpret_cast<const void *>(offset)
+		);
+		upload_offset += bytes;
+		return;
+	}
+
+	// Upload directly from the capture buffer
+	if (upload_buffer != 0) {
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->get_width());
+	glTexSubImage2D(
+		GL_TEXTURE_2D, 0,
+		rect.x(), rect.y(),
+		rect.width(), rect.height(),
+		upload_format, upload_type,
+		src
+	);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	if (upload_buffer != 0) {
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+	}
+}
+
+void GLPresenter::expose(const QRegion &region) {
+	if (suspended) {
+		return;
+	}
+	window->make_current();
+	draw();
+	count_presented(region);
+}
+
+void GLPresenter::draw() {
+	// The back buffer isn't preserved across swaps, so we draw everything
+	renderer->draw(texture, QRect(0, 0, geometry.width(), geometry.height()), geometry.width(), geometry.height());
+	window->swap_buffers();
+}
+
+bool GLPresenter::paints_on_screen() {
+	return true;
+}
+
+void GLPresenter::suspend() {
+	suspended = true;
+	window->release_surface();
+}
+
+void GLPresenter::resume() {
+	// The surface is created again the next time we draw
+	suspended = false;
+}
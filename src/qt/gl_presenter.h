@@ -0,0 +1,100 @@
+#ifndef QT_GL_PRESENTER_H
+#define QT_GL_PRESENTER_H
+
+#include <QRect>
+
+#include "egl.h"
+#include "gl_renderer.h"
+#include "presenter.h"
+
+// Number of pixel buffer segments we rotate through when uploading, so we can
+// fill one while the GPU is still reading the previous one
+#define GL_PRESENTER_UPLOAD_SEGMENTS 2
+
+// Keeps the monitor's contents in a GL texture and streams damaged rects
+// straight from the capture buffer into it, then draws it on the window.
+// This moves the final copy to the screen off the CPU on machines that have a
+// working GL driver but can't use DMA-BUF (e.g. NVIDIA's proprietary driver).
+//
+// Uploads go through a persistently mapped pixel buffer object when the driver
+// supports it (GL_ARB_buffer_storage and GL_ARB_sync), so the driver can DMA
+// the pixels while we go on with the next frame. Otherwise they're uploaded
+// directly from the capture buffer.
+//
+// This has no CPU side framebuffer, the texture holds the screen contents, so
+// redraws just draw it again. Rects are uploaded in the capture format, the
+// driver converts them to the texture's.
+class GLPresenter : public Presenter {
+public:
+	// geometry is the part of the session the window shows, in frames of
+	// capture_format
+	// Throws std::runtime_error if GL can't be used, which it can't without
+	// caps (caps must outlive us)
+	GLPresenter(const EGLCapabilities *caps, WId window_id, const QRect &geometry, enum pixel_format capture_format);
+	~GLPresenter();
+
+	const char *get_name() override;
+	QImage *get_framebuffer() override;
+	bool copies_frames() override;
+	void begin_update(const std::shared_ptr<Frame> &frame) override;
+	void present(const QRegion &region) override;
+	void expose(const QRegion &region) override;
+	bool paints_on_screen() override;
+	void suspend() override;
+	void resume() override;
+
+private:
+	// Resolve the functions we need for persistently mapped uploads, returns
+	// false if the driver doesn't have them
+	bool setup_upload_buffer();
+
+	// Upload a rect of the current frame (in window coordinates) into the
+	// texture, non_temporal is decided for the whole update
+	void upload_rect(const QRect &rect, bool non_temporal);
+
+	// Draw the texture to the window and swap
+	void draw();
+
+	// Free everything we allocated, used by the destructor and when the
+	// constructor fails halfway
+	void cleanup();
+
+	EGLWindow *window = nullptr;
+	QRect geometry;
+	GLuint texture = 0;
+	GLRenderer *renderer = nullptr;
+
+	// How the capture buffer's pixels are described to glTexSubImage2D
+	int bytes_per_pixel;
+	GLenum upload_format;
+	GLenum upload_type;
+	blit_rect_func upload_blit;
+
+	// The frame being presented, set by begin_update and dropped as soon as
+	// its uploads are issued, before drawing and swapping
+	std::shared_ptr<Frame> frame;
+
+	// Whether DMA-BUF has the window, in which case we don't touch it
+	bool suspended = false;
+
+	// The persistently mapped upload buffer, split into segments, and the
+	// fences that tell us when the GPU is done reading each segment
+	GLuint upload_buffer = 0;
+	uint8_t *upload_addr = nullptr;
+	size_t upload_segment_size = 0;
+	int upload_segment = 0;
+	size_t upload_offset = 0;
+	GLsync upload_fences[GL_PRESENTER_UPLOAD_SEGMENTS] = {};
+
+	PFNGLGENBUFFERSPROC gl_gen_buffers = nullptr;
+	PFNGLDELETEBUFFERSPROC gl_delete_buffers = nullptr;
+	PFNGLBINDBUFFERPROC gl_bind_buffer = nullptr;
+	PFNGLBUFFERSTORAGEPROC gl_buffer_storage = nullptr;
+	PFNGLMAPBUFFERRANGEPROC gl_map_buffer_range = nullptr;
+	PFNGLUNMAPBUFFERPROC gl_unmap_buffer = nullptr;
+	PFNGLFENCESYNCPROC gl_fence_sync = nullptr;
+	PFNGLCLIENTWAITSYNCPROC gl_client_wait_sync = nullptr;
+	PFNGLDELETESYNCPROC gl_delete_sync = nullptr;
+};
+
+#endif
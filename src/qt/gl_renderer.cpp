@@ -0,0 +1,185 @@
+#include <stdexcept>
+#include <string>
+
+#include "common.h"
+#include "gl_renderer.h"
+
+// The attribute location of the quad's corners
+#define GL_RENDERER_POSITION_ATTRIB 0
+
+// Both shaders are valid GLSL ES 1.00 and GLSL 1.10, precision qualifiers
+// only exist on GLES. The quad's corners go from (0, 0) at the top left to
+// (1, 1) at the bottom right, and source maps them to the texture.
+static const char *vertex_shader_source =
+	"attribute vec2 position;\n"
+	"uniform vec4 source;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"	texcoord = source.xy + position * source.zw;\n"
+	"	gl_Position = vec4(position.x * 2.0 - 1.0, 1.0 - position.y * 2.0, 0.0, 1.0);\n"
+	"}\n";
+
+// Texture coordinates need more than mediump to address every texel of a big
+// screen
+static const char *fragment_shader_source =
+	"#ifdef GL_ES\n"
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"#endif\n"
+	"uniform sampler2D image;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"	gl_FragColor = vec4(texture2D(image, texcoord).rgb, 1.0);\n"
+	"}\n";
+
+// A triangle strip covering the viewport
+static const GLfloat quad_vertices[] = {
+	0.0f, 0.0f,
+	1.0f, 0.0f,
+	0.0f, 1.0f,
+	1.0f, 1.0f,
+};
+
+template <typename T>
+static void resolve(T &function, const char *name) {
+	function = reinterpret_cast<T>(eglGetProcAddress(name));
+	if (function == nullptr) {
+		throw std::runtime_error(std::string(name) + " isn't available");
+	}
+}
+
+GLRenderer::GLRenderer() {
+	try {
+		resolve(gl_create_shader, "glCreateShader");
+		resolve(gl_shader_source, "glShaderSource");
+		resolve(gl_compile_shader, "glCompileShader");
+		resolve(gl_get_shader_iv, "glGetShaderiv");
+		resolve(gl_get_shader_info_log, "glGetShaderInfoLog");
+		resolve(gl_delete_shader, "glDeleteShader");
+		resolve(gl_create_program, "glCreateProgram");
+		resolve(gl_attach_shader, "glAttachShader");
+		resolve(gl_bind_attrib_location, "glBindAttribLocation");
+		resolve(gl_link_program, "glLinkProgram");
+		resolve(gl_get_program_iv, "glGetProgramiv");
+		resolve(gl_get_program_info_log, "glGetProgramInfoLog");
+		resolve(gl_delete_program, "glDeleteProgram");
+		resolve(gl_use_program, "glUseProgram");
+		resolve(gl_get_uniform_location, "glGetUniformLocation");
+		resolve(gl_uniform_1i, "glUniform1i");
+		resolve(gl_uniform_4f, "glUniform4f");
+		resolve(gl_gen_buffers, "glGenBuffers");
+		resolve(gl_delete_buffers, "glDeleteBuffers");
+		resolve(gl_bind_buffer, "glBindBuffer");
+		resolve(gl_buffer_data, "glBufferData");
+		resolve(gl_vertex_attrib_pointer, "glVertexAttribPointer");
+		resolve(gl_enable_vertex_attrib_array, "glEnableVertexAttribArray");
+
+		vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+		fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
+		if (vertex_shader == 0 || fragment_shader == 0) {
+			throw std::runtime_error("compiling the shaders failed");
+		}
+
+		program = gl_create_program();
+		gl_attach_shader(program, vertex_shader);
+		gl_attach_shader(program, fragment_shader);
+		gl_bind_attrib_location(program, GL_RENDERER_POSITION_ATTRIB, "position");
+		gl_link_program(program);
+		GLint linked = GL_FALSE;
+		gl_get_program_iv(program, GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE) {
+			char info_log[1024] = "";
+			gl_get_program_info_log(program, sizeof(info_log), nullptr, info_log);
+			log(LOG_WARN, "GLRenderer: linking the shaders failed: %s\n", info_log);
+			throw std::runtime_error("linking the shaders failed");
+		}
+
+		gl_use_program(program);
+		source_uniform = gl_get_uniform_location(program, "source");
+		gl_uniform_1i(gl_get_uniform_location(program, "image"), 0);
+
+		gl_gen_buffers(1, &vertex_buffer);
+		gl_bind_buffer(GL_ARRAY_BUFFER, vertex_buffer);
+		gl_buffer_data(GL_ARRAY_BUFFER, sizeof(quad_vertices), quad_vertices, GL_STATIC_DRAW);
+		gl_vertex_attrib_pointer(GL_RENDERER_POSITION_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+		gl_enable_vertex_attrib_array(GL_RENDERER_POSITION_ATTRIB);
+
+		if (glGetError() != GL_NO_ERROR) {
+			throw std::runtime_error("setting up the vertex buffer failed");
+		}
+	} catch (...) {
+		cleanup();
+		throw;
+	}
+}
+
+GLRenderer::~GLRenderer() {
+	cleanup();
+}
+
+void GLRenderer::cleanup() {
+	if (vertex_buffer != 0) {
+		gl_bind_buffer(GL_ARRAY_BUFFER, 0);
+		gl_delete_buffers(1, &vertex_buffer);
+		vertex_buffer = 0;
+	}
+	if (program != 0) {
+		gl_use_program(0);
+		gl_delete_program(program);
+		program = 0;
+	}
+	if (vertex_shader != 0) {
+		gl_delete_shader(vertex_shader);
+		vertex_shader = 0;
+	}
+	if (fragment_shader != 0) {
+		gl_delete_shader(fragment_shader);
+		fragment_shader = 0;
+	}
+}
+
+void GLRenderer::abandon() {
+	vertex_buffer = 0;
+	program = 0;
+	vertex_shader = 0;
+	fragment_shader = 0;
+}
+
+GLuint GLRenderer::compile_shader(GLenum type, const char *source) {
+	GLuint shader = gl_create_shader(type);
+	if (shader == 0) {
+		return 0;
+	}
+	gl_shader_source(shader, 1, &source, nullptr);
+	gl_compile_shader(shader);
+	GLint compiled = GL_FALSE;
+	gl_get_shader_iv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled != GL_TRUE) {
+		char info_log[1024] = "";
+		gl_get_shader_info_log(shader, sizeof(info_log), nullptr, info_log);
+		log(LOG_WARN, "GLRenderer: compiling a shader failed: %s\n", info_log);
+		gl_delete_shader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+void GLRenderer::draw(GLuint texture, const QRect &source, int texture_width, int texture_height) {
+	GLfloat x = static_cast<GLfloat>(source.x()) / texture_width;
+	GLfloat y = static_cast<GLfloat>(source.y()) / texture_height;
+	GLfloat cx = static_cast<GLfloat>(source.width()) / texture_width;
+	GLfloat cy = static_cast<GLfloat>(source.height()) / texture_height;
+	if (x != this->source[0] || y != this->source[1] || cx != this->source[2] || cy != this->source[3]) {
+		gl_uniform_4f(source_uniform, x, y, cx, cy);
+		this->source[0] = x;
+		this->source[1] = y;
+		this->source[2] = cx;
+		this->source[3] = cy;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
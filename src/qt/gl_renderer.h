@@ -0,0 +1,78 @@
+#ifndef QT_GL_RENDERER_H
+#define QT_GL_RENDERER_H
+
+#include <QRect>
+
+#include "egl.h"
+
+// Draws part of a texture over the whole viewport with a trivial shader and a
+// vertex buffer holding one quad, which works the same on desktop GL (2.0 and
+// up) and on GLES 2/3 (like v3d and most ARM GPUs), unlike the fixed function
+// pipeline.
+// Everything is set up once when it's created and left bound, so drawing is a
+// texture bind, at most one uniform update and a draw call. That means the
+// context must not be used to draw anything else.
+class GLRenderer {
+public:
+	// Must be called with the context current
+	// Throws std::runtime_error if the shaders can't be used
+	GLRenderer();
+	// Must be called with the context current, unless abandon was called
+	~GLRenderer();
+
+	GLRenderer(const GLRenderer &) = delete;
+	GLRenderer &operator=(const GLRenderer &) = delete;
+
+	// Draw the source rect of a texture_width by texture_height texture (in
+	// texels, rows top to bottom like the capture buffer) over the viewport
+	void draw(GLuint texture, const QRect &source, int texture_width, int texture_height);
+
+	// Forget our GL objects without deleting them, for when the context
+	// can't be made current anymore, they're freed with it
+	void abandon();
+
+private:
+	// Compile one of our shaders, returns 0 and logs why if it fails
+	GLuint compile_shader(GLenum type, const char *source);
+
+	// Free everything, used by the destructor and when the constructor fails
+	// halfway
+	void cleanup();
+
+	GLuint vertex_shader = 0;
+	GLuint fragment_shader = 0;
+	GLuint program = 0;
+	GLuint vertex_buffer = 0;
+
+	// The source rect of the last draw, as set in the uniform, which stays
+	// the same frame after frame
+	GLint source_uniform = -1;
+	GLfloat source[4] = { -1.0f, -1.0f, -1.0f, -1.0f };
+
+	// Shader functions aren't in the GL 1.x ABI, so they're looked up
+	PFNGLCREATESHADERPROC gl_create_shader = nullptr;
+	PFNGLSHADERSOURCEPROC gl_shader_source = nullptr;
+	PFNGLCOMPILESHADERPROC gl_compile_shader = nullptr;
+	PFNGLGETSHADERIVPROC gl_get_shader_iv = nullptr;
+	PFNGLGETSHADERINFOLOGPROC gl_get_shader_info_log = nullptr;
+	PFNGLDELETESHADERPROC gl_delete_shader = nullptr;
+	PFNGLCREATEPROGRAMPROC gl_create_program = nullptr;
+	PFNGLATTACHSHADERPROC gl_attach_shader = nullptr;
+	PFNGLBINDATTRIBLOCATIONPROC gl_bind_attrib_location = nullptr;
+	PFNGLLINKPROGRAMPROC gl_link_program = nullptr;
+	PFNGLGETPROGRAMIVPROC gl_get_program_iv = nullptr;
+	PFNGLGETPROGRAMINFOLOGPROC gl_get_program_info_log = nullptr;
+	PFNGLDELETEPROGRAMPROC gl_delete_program = nullptr;
+	PFNGLUSEPROGRAMPROC gl_use_program = nullptr;
+	PFNGLGETUNIFORMLOCATIONPROC gl_get_uniform_location = nullptr;
+	PFNGLUNIFORM1IPROC gl_uniform_1i = nullptr;
+	PFNGLUNIFORM4FPROC gl_uniform_4f = nullptr;
+	PFNGLGENBUFFERSPROC gl_gen_buffers = nullptr;
+	PFNGLDELETEBUFFERSPROC gl_delete_buffers = nullptr;
+	PFNGLBINDBUFFERPROC gl_bind_buffer = nullptr;
+	PFNGLBUFFERDATAPROC gl_buffer_data = nullptr;
+	PFNGLVERTEXATTRIBPOINTERPROC gl_vertex_attrib_pointer = nullptr;
+	PFNGLENABLEVERTEXATTRIBARRAYPROC gl_enable_vertex_attrib_array = nullptr;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include <QPainter>
+#include <cstring>
+#include <stdexcept>
+
+#include "common.h"
+#include "presenter.h"
+#include "framebuffer.h"
+#include "xshm_presenter.h"
+#include "gl_presenter.h"
+
+bool presenter_type_from_string(const char *name, enum presenter_type *type) {
+	if (strcmp(name, "auto") == 0) {
+		*type = PRESENTER_AUTO;
+	} else if (strcmp(name, "qpainter") == 0) {
+		*type = PRESENTER_QPAINTER;
+	} else if (strcmp(name, "xshm") == 0) {
+		*type = PRESENTER_XSHM;
+	} else if (strcmp(name, "alias") == 0) {
+		*type = PRESENTER_ALIAS;
+	} else if (strcmp(name, "gl") == 0) {
+		*type = PRESENTER_GL;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+Presenter::Presenter() : presented_pixels("presented pixels", "pixels", STATS_LOG_EVERY) {
+}
+
+Presenter::~Presenter() {
+}
+
+enum pixel_format Presenter::get_framebuffer_format() {
+	return PIXEL_FORMAT_XRGB8888;
+}
+
+bool Presenter::copies_frames() {
+	return true;
+}
+
+void Presenter::begin_update(const std::shared_ptr<Frame> &frame) {
+}
+
+bool Presenter::supports_scroll() {
+	return false;
+}
+
+void Presenter::scroll(const QRect &rect, int dy) {
+}
+
+void Presenter::suspend() {
+}
+
+void Presenter::resume() {
+}
+
+void Presenter::count_presented(const QRegion &region) {
+	long pixels = 0;
+	for (const QRect &rect : region) {
+		pixels += static_cast<long>(rect.width()) * rect.height();
+	}
+	presented_pixels.add(pixels);
+}
+
+QPainterPresenter::QPainterPresenter(QWidget *window, int width, int height, enum pixel_format format) {
+	this->window = window;
+	this->width = width;
+	this->height = height;
+	this->format = format;
+	framebuffer = alloc_framebuffer(width, height, format);
+}
+
+const char *QPainterPresenter::get_name() {
+	return "qpainter";
+}
+
+QImage *QPainterPresenter::get_framebuffer() {
+	return &framebuffer;
+}
+
+enum pixel_format QPainterPresenter::get_framebuffer_format() {
+	return format;
+}
+
+void QPainterPresenter::present(const QRegion &region) {
+	window->update(region);
+}
+
+void QPainterPresenter::expose(const QRegion &region) {
+	QPainter painter(window);
+	for (const QRect &rect : region) {
+		if (framebuffer.isNull()) {
+			painter.fillRect(rect, Qt::black);
+		} else {
+			painter.drawImage(rect, framebuffer, rect);
+		}
+	}
+	count_presented(region);
+}
+
+bool QPainterPresenter::paints_on_screen() {
+	return false;
+}
+
+bool QPainterPresenter::supports_scroll() {
+	return true;
+}
+
+void QPainterPresenter::scroll(const QRect &rect, int dy) {
+	// This moves the backing store's pixels (and the parts of it waiting to
+	// be repainted), and repaints the rows scrolled in
+	window->scroll(0, -dy, rect);
+}
+
+void QPainterPresenter::suspend() {
+	// Nothing is painted from the framebuffer while DMA-BUF has the window
+	framebuffer = QImage();
+}
+
+void QPainterPresenter::resume() {
+	framebuffer = alloc_framebuffer(width, height, format);
+}
+
+AliasPresenter::AliasPresenter(QWidget *window, const QPoint &origin, enum pixel_format capture_format, std::function<void()> request_refresh) {
+	this->window = window;
+	this->origin = origin;
+	this->capture_format = capture_format;
+	this->request_refresh = std::move(request_refresh);
+}
+
+const char *AliasPresenter::get_name() {
+	return "alias";
+}
+
+QImage *AliasPresenter::get_framebuffer() {
+	return &framebuffer;
+}
+
+enum pixel_format AliasPresenter::get_framebuffer_format() {
+	return capture_format;
+}
+
+bool AliasPresenter::copies_frames() {
+	return false;
+}
+
+void AliasPresenter::begin_update(const std::shared_ptr<Frame> &frame) {
+	// The capture buffer only changes on resize, so only rewrap it then
+	if (framebuffer.constBits() != frame->get_data() || framebuffer.width() != frame->get_width() || framebuffer.height() != frame->get_height()) {
+		// The capture buffer is mapped read-only, so make sure QImage never
+		// writes to it
+		framebuffer = QImage(static_cast<const unsigned char *>(frame->get_data()), frame->get_width(), frame->get_height(), frame->get_width() * pixel_format_bytes(capture_format), qimage_format(capture_format));
+	}
+	buffer = frame->get_buffer();
+	this->frame = frame;
+	refresh_requested = false;
+}
+
+void AliasPresenter::present(const QRegion &region) {
+	window->repaint(region);
+	frame = nullptr;
+}
+
+void AliasPresenter::expose(const QRegion &region) {
+	QPainter painter(window);
+	if (frame == nullptr) {
+		// Not called from present, so the capture buffer may be half way
+		// through the next frame
+		for (const QRect &rect : region) {
+			painter.fillRect(rect, Qt::black);
+		}
+		if (!framebuffer.isNull() && !refresh_requested) {
+			request_refresh();
+			refresh_requested = true;
+		}
+		return;
+	}
+	for (const QRect &rect : region) {
+		painter.drawImage(rect, framebuffer, rect.translated(origin));
+	}
+	count_presented(region);
+}
+
+bool AliasPresenter::paints_on_screen() {
+	return false;
+}
+
+void AliasPresenter::suspend() {
+	// xorgxrdp may free or reuse the capture buffer while DMA-BUF has the
+	// window, so let go of it, the next frame after resume wraps it again
+	framebuffer = QImage();
+	buffer = nullptr;
+}
+
+Presenter *create_presenter(enum presenter_type type, const char *x11_display, const EGLCapabilities *egl_caps, QWidget *window, const QRect &geometry, enum pixel_format capture_format, std::function<void()> request_refresh) {
+	int width = geometry.width();
+	int height = geometry.height();
+	if (type == PRESENTER_ALIAS) {
+		return new AliasPresenter(window, geometry.topLeft(), capture_format, std::move(request_refresh));
+	}
+	if (type == PRESENTER_GL) {
+		try {
+			return new GLPresenter(egl_caps, window->winId(), geometry, capture_format);
+		} catch (const std::exception &e) {
+			log(LOG_WARN, "Can't use the GL presenter (%s), falling back to MIT-SHM.\n", e.what());
+			type = PRESENTER_XSHM;
+		}
+	}
+	if (type == PRESENTER_AUTO || type == PRESENTER_XSHM) {
+		try {
+			return new XShmPresenter(x11_display, window->winId(), width, height);
+		} catch (const std::exception &e) {
+			log(type == PRESENTER_XSHM ? LOG_WARN : LOG_INFO, "Can't use the MIT-SHM presenter (%s), falling back to QPainter.\n", e.what());
+		}
+	}
+	return new QPainterPresenter(window, width, height, capture_format);
+}
@@ -0,0 +1,183 @@
+#ifndef QT_PRESENTER_H
+#define QT_PRESENTER_H
+
+// Presenters put the framebuffer on the screen when not using DMA-BUF.
+// The window copies damaged rects from xorgxrdp into the presenter's
+// framebuffer and then asks the presenter to present the damaged region.
+
+#include <functional>
+#include <memory>
+#include <QImage>
+#include <QRegion>
+#include <QWidget>
+
+#include "stats.h"
+#include "frame.h"
+#include "blit.h"
+
+class EGLCapabilities;
+
+enum presenter_type {
+	// Use the fastest presenter that works in our environment
+	PRESENTER_AUTO,
+	// Paint through Qt's backing store
+	PRESENTER_QPAINTER,
+	// Keep the framebuffer in MIT-SHM shared memory and put it on the window
+	// directly
+	PRESENTER_XSHM,
+	// Paint through Qt's backing store straight from xorgxrdp's capture
+	// buffer, without a framebuffer of our own
+	PRESENTER_ALIAS,
+	// Upload damaged rects into a GL texture per monitor and draw them
+	PRESENTER_GL,
+};
+
+// Parse a presenter name given on the command line, returns false if the name
+// is unknown
+bool presenter_type_from_string(const char *name, enum presenter_type *type);
+
+class Presenter {
+public:
+	Presenter();
+	virtual ~Presenter();
+
+	// The name of the presenter, for logging
+	virtual const char *get_name() = 0;
+
+	// The framebuffer damaged rects are copied into
+	virtual QImage *get_framebuffer() = 0;
+
+	// The pixel format of the framebuffer, the window converts damaged rects
+	// to it when the capture format is another one
+	virtual enum pixel_format get_framebuffer_format();
+
+	// Whether the window has to copy damaged rects into the framebuffer,
+	// presenters that read straight from the capture buffer don't need it
+	virtual bool copies_frames();
+
+	// Prepare the framebuffer for a frame, called before copying its damaged
+	// rects into it
+	// Presenters that don't copy frames keep their own reference to it for
+	// as long as they read the capture buffer, the window drops its own
+	// before present, so the frame is released as soon as they're done.
+	virtual void begin_update(const std::shared_ptr<Frame> &frame);
+
+	// Show a region of the framebuffer that was just updated
+	virtual void present(const QRegion &region) = 0;
+
+	// Whether the presenter can move the contents of the screen by itself,
+	// in which case the window looks for scrolls in the damage
+	virtual bool supports_scroll();
+
+	// Move the contents of rect on the screen up by dy rows (down if
+	// negative), called after the framebuffer was updated and before
+	// present, which then only has to show the rows that are actually new
+	virtual void scroll(const QRect &rect, int dy);
+
+	// Redraw a region the window system asked us to redraw (e.g. because it
+	// was covered by another window), called from the window's paintEvent
+	virtual void expose(const QRegion &region) = 0;
+
+	// Whether the presenter draws on the window by itself, in which case Qt
+	// must not paint the window
+	virtual bool paints_on_screen() = 0;
+
+	// Called when DMA-BUF takes over the window and when it gives it back
+	// The framebuffer may be freed while suspended (get_framebuffer then
+	// returns a null image), and is blank after resume, so the caller has to
+	// ask xorgxrdp for a full refresh.
+	virtual void suspend();
+	virtual void resume();
+
+protected:
+	// Count the pixels in a region we sent to the screen
+	void count_presented(const QRegion &region);
+
+private:
+	StatCounter presented_pixels;
+};
+
+// Presents through Qt's backing store, present schedules a repaint of the
+// region using QWidget::update and expose paints it.
+// This works everywhere, but costs an extra copy of every update (from our
+// framebuffer to the backing store, and then from it to the X server).
+// The framebuffer is in the capture format, so copying into it never
+// converts, and a reduced depth capture halves it too.
+class QPainterPresenter : public Presenter {
+public:
+	QPainterPresenter(QWidget *window, int width, int height, enum pixel_format format);
+
+	const char *get_name() override;
+	QImage *get_framebuffer() override;
+	enum pixel_format get_framebuffer_format() override;
+	void present(const QRegion &region) override;
+	void expose(const QRegion &region) override;
+	bool paints_on_screen() override;
+	bool supports_scroll() override;
+	void scroll(const QRect &rect, int dy) override;
+	void suspend() override;
+	void resume() override;
+
+private:
+	QWidget *window;
+	int width;
+	int height;
+	enum pixel_format format;
+	QImage framebuffer;
+};
+
+// Presents through Qt's backing store like QPainterPresenter, but the
+// framebuffer is xorgxrdp's capture buffer itself (of which the window shows
+// the part at origin), so there's no copy into a
+// framebuffer of our own and no full-size allocation for it.
+// The capture buffer is only stable until the frame is acknowledged, so
+// present repaints synchronously, before the window releases the frame.
+// Once it's released, xorgxrdp may be writing the next frame into it, so
+// redraws the window system asks for in between aren't painted from it:
+// they're painted black and request_refresh asks xorgxrdp for the whole
+// screen again, which repaints them from a frame we hold.
+class AliasPresenter : public Presenter {
+public:
+	AliasPresenter(QWidget *window, const QPoint &origin, enum pixel_format capture_format, std::function<void()> request_refresh);
+
+	const char *get_name() override;
+	QImage *get_framebuffer() override;
+	enum pixel_format get_framebuffer_format() override;
+	bool copies_frames() override;
+	void begin_update(const std::shared_ptr<Frame> &frame) override;
+	void present(const QRegion &region) override;
+	void expose(const QRegion &region) override;
+	bool paints_on_screen() override;
+	void suspend() override;
+
+private:
+	QWidget *window;
+	QPoint origin;
+	enum pixel_format capture_format;
+
+	// Wraps the capture buffer of the last frame, null before the first one
+	QImage framebuffer;
+
+	// The frame being presented, until present has repainted it
+	std::shared_ptr<Frame> frame;
+
+	// Asks xorgxrdp for a full refresh, at most once until the next frame
+	std::function<void()> request_refresh;
+	bool refresh_requested = false;
+
+	// Keeps the capture buffer mapped for redraws between frames
+	std::shared_ptr<void> buffer;
+};
+
+// Create a presenter of the given type for the window, falls back to
+// QPainterPresenter if the requested presenter can't be used
+// geometry is the part of the session the window shows, in frames of
+// capture_format
+// egl_caps is what EGL can do on the display, or null if it can't be used
+// request_refresh asks xorgxrdp to send the whole session again, for
+// presenters that can't redraw the window by themselves
+// Presenters that paint on screen may be used from any one thread after
+// they're created, the others must only be used from the Qt thread.
+Presenter *create_presenter(enum presenter_type type, const char *x11_display, const EGLCapabilities *egl_caps, QWidget *window, const QRect &geometry, enum pixel_format capture_format, std::function<void()> request_refresh);
+
+#endif
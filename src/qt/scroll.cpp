@@ -0,0 +1,133 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "scroll.h"
+
+ScrollDetector::ScrollDetector(int bytes_per_pixel) {
+	this->bytes_per_pixel = bytes_per_pixel;
+	hashed_rect = { .x = 0, .y = 0, .cx = 0, .cy = 0 };
+}
+
+void ScrollDetector::hash_rows(const uint8_t *data, size_t stride, const blit_rect_spec &rect, std::vector<uint64_t> &hashes) {
+	const uint64_t multiplier = 0xff51afd7ed558ccdULL;
+	size_t bytes = static_cast<size_t>(rect.cx) * bytes_per_pixel;
+	hashes.resize(rect.cy);
+	for (int y = 0; y < rect.cy; y++) {
+		const uint8_t *row = data + (rect.y + y) * stride + rect.x * bytes_per_pixel;
+
+		// Four independent lanes, so the multiplies overlap
+		uint64_t lanes[4] = { bytes, bytes + 1, bytes + 2, bytes + 3 };
+		size_t i = 0;
+		for (; i + 32 <= bytes; i += 32) {
+			for (int lane = 0; lane < 4; lane++) {
+				uint64_t word;
+				memcpy(&word, row + i + lane * 8, 8);
+				lanes[lane] = (lanes[lane] ^ word) * multiplier;
+				lanes[lane] ^= lanes[lane] >> 29;
+			}
+		}
+		uint64_t hash = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+		for (; i + 2 <= bytes; i += 2) {
+			uint16_t word;
+			memcpy(&word, row + i, 2);
+			hash = (hash ^ word) * multiplier;
+			hash ^= hash >> 29;
+		}
+		hashes[y] = hash;
+	}
+}
+
+int ScrollDetector::detect(
+	const uint8_t *framebuffer, size_t framebuffer_stride,
+	const uint8_t *src, size_t src_stride,
+	const blit_rect_spec &rect
+) {
+	new_rows.clear();
+	if (static_cast<long>(rect.cx) * rect.cy < SCROLL_DETECT_MIN_PIXELS) {
+		invalidate(rect);
+		return 0;
+	}
+
+	bool same_rect = hashed_valid && hashed_rect.x == rect.x && hashed_rect.y == rect.y && hashed_rect.cx == rect.cx && hashed_rect.cy == rect.cy;
+	if (!same_rect) {
+		if (framebuffer == nullptr) {
+			// Nothing to compare with, just remember the new rows for next time
+			hash_rows(src, src_stride, rect, old_hashes);
+			hashed_rect = rect;
+			hashed_valid = true;
+			return 0;
+		}
+		hash_rows(framebuffer, framebuffer_stride, rect, old_hashes);
+	}
+	hash_rows(src, src_stride, rect, new_hashes);
+
+	// Each new row that's somewhere in the old rows votes for it having moved
+	// there. Rows that appear more than once (like blank ones) say nothing
+	// about where they moved.
+	old_rows.clear();
+	for (int y = 0; y < rect.cy; y++) {
+		auto [row, inserted] = old_rows.emplace(old_hashes[y], y);
+		if (!inserted) {
+			row->second = -1;
+		}
+	}
+	votes.clear();
+	for (int y = 0; y < rect.cy; y++) {
+		auto row = old_rows.find(new_hashes[y]);
+		if (row != old_rows.end() && row->second >= 0) {
+			votes[row->second - y]++;
+		}
+	}
+	int dy = 0;
+	int best = 0;
+	for (auto [candidate, count] : votes) {
+		if (count > best || (count == best && (abs(candidate) < abs(dy) || (abs(candidate) == abs(dy) && candidate < dy)))) {
+			dy = candidate;
+			best = count;
+		}
+	}
+
+	if (dy != 0) {
+		// Count every row the move accounts for, repeated ones included, and
+		// collect the ones it doesn't
+		int matched = 0;
+		for (int y = 0; y < rect.cy; y++) {
+			int old_y = y + dy;
+			if (old_y >= 0 && old_y < rect.cy && new_hashes[y] == old_hashes[old_y]) {
+				matched++;
+				continue;
+			}
+			if (!new_rows.empty() && new_rows.back().y + new_rows.back().cy == rect.y + y) {
+				new_rows.back().cy++;
+			} else {
+				new_rows.push_back({ .x = rect.x, .y = rect.y + y, .cx = rect.cx, .cy = 1 });
+			}
+		}
+		if (matched * 100 < rect.cy * SCROLL_MIN_MATCH_PERCENT) {
+			dy = 0;
+			new_rows.clear();
+		}
+	}
+
+	// This is what the framebuffer holds once the rect is copied
+	old_hashes.swap(new_hashes);
+	hashed_rect = rect;
+	hashed_valid = true;
+	return dy;
+}
+
+const std::vector<blit_rect_spec> &ScrollDetector::get_new_rows() {
+	return new_rows;
+}
+
+void ScrollDetector::invalidate(const blit_rect_spec &rect) {
+	if (hashed_valid &&
+		rect.x < hashed_rect.x + hashed_rect.cx && hashed_rect.x < rect.x + rect.cx &&
+		rect.y < hashed_rect.y + hashed_rect.cy && hashed_rect.y < rect.y + rect.cy) {
+		hashed_valid = false;
+	}
+}
+
+void ScrollDetector::reset() {
+	hashed_valid = false;
+}
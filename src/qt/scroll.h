@@ -0,0 +1,81 @@
+#ifndef QT_SCROLL_H
+#define QT_SCROLL_H
+
+// Scroll detection
+// xorgxrdp doesn't tell us when something scrolled (there's no screen_blt
+// in the shared memory path), a scrolling browser or terminal just damages
+// the whole scrolled area. ScrollDetector compares hashes of the rows of a
+// damaged rect in the framebuffer (what's on screen) and in the new frame to
+// find out if the new contents are the old ones moved up or down, so the
+// presenter can move them on screen and only put the rows that are actually
+// new.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+#include "blit_pool.h"
+
+// Rects smaller than this many pixels are presented as they are, detecting a
+// scroll in them costs more than it saves
+#define SCROLL_DETECT_MIN_PIXELS (256 * 1024)
+
+// A scroll is only used if at least this percentage of the rect's rows can
+// be reused from the screen
+#define SCROLL_MIN_MATCH_PERCENT 50
+
+class ScrollDetector {
+public:
+	// bytes_per_pixel is the pixel size of the frames (and of the
+	// framebuffer, when detect is given one)
+	ScrollDetector(int bytes_per_pixel);
+
+	// Find how many rows the contents of rect moved between the framebuffer
+	// and the new frame (positive if they moved up, i.e. new row y is old
+	// row y + dy), or 0 if they didn't.
+	// Must be called before the rect is copied into the framebuffer. If a
+	// move is found, the rows that it doesn't account for (the ones
+	// scrolled in and the ones that changed) are in get_new_rows.
+	// framebuffer is null if it's in another pixel format than the frames,
+	// then only the hashes kept from the last detect are compared with, so
+	// a rect is only found to scroll from the second time it's damaged.
+	int detect(
+		const uint8_t *framebuffer, size_t framebuffer_stride,
+		const uint8_t *src, size_t src_stride,
+		const blit_rect_spec &rect
+	);
+
+	// The rows of the last rect detect found a move in that have to be
+	// presented after the move, as rects
+	const std::vector<blit_rect_spec> &get_new_rows();
+
+	// Called when a rect of the framebuffer was written without going
+	// through detect
+	void invalidate(const blit_rect_spec &rect);
+
+	// Called when the whole framebuffer was replaced
+	void reset();
+
+private:
+	int bytes_per_pixel;
+
+	// Hash each row of a rect
+	void hash_rows(const uint8_t *data, size_t stride, const blit_rect_spec &rect, std::vector<uint64_t> &hashes);
+
+	// The hashes of the framebuffer's rows in hashed_rect, as left by the
+	// last detect, so a rect that's damaged frame after frame (the usual
+	// case when scrolling) doesn't have to be hashed twice
+	blit_rect_spec hashed_rect;
+	bool hashed_valid = false;
+	std::vector<uint64_t> old_hashes;
+	std::vector<uint64_t> new_hashes;
+
+	std::vector<blit_rect_spec> new_rows;
+
+	// Scratch space for detect, kept to avoid reallocating
+	std::unordered_map<uint64_t, int> old_rows;
+	std::unordered_map<int, int> votes;
+};
+
+#endif
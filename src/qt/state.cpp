@@ -11,20 +11,27 @@
 #include <QThread>
 #include <QBitmap>
 #include <X11/Xlib.h>
+#include <thread>
+#include <algorithm>
+#include <cinttypes>
 
 static int fake_argc = 1;
 static char *fake_argv[] = { reinterpret_cast<char *>(const_cast<char *>("xrdp_local")), nullptr };
 
-QtState::QtState(XRDPLocalState *xrdp_local, int max_displays, bool use_dma_buf) : app_ready_latch(1)
+QtState::QtState(XRDPLocalState *xrdp_local, int max_displays, bool use_dma_buf, enum presenter_type presenter_type, enum pixel_format capture_format, bool vblank_pacing, int frames_in_flight) :
+	ack_credits(frames_in_flight - 1),
+	early_acks("frames acknowledged before vblank", "frames", STATS_LOG_EVERY),
+	app_ready_latch(1)
 {
 	this->xrdp_local = xrdp_local;
 	this->max_displays = max_displays;
 	this->use_dma_buf = use_dma_buf;
+	this->presenter_type = presenter_type;
+	this->capture_format = capture_format;
 
 	QCoreApplication::setAttribute(Qt::AA_Use96Dpi);
 
 	app = new QApplication(fake_argc, fake_argv);
-	window = nullptr;
 
 	displays_to_use = QGuiApplication::screens().count();
 	log(LOG_DEBUG, "Got %d displays from qt, max set at %d\n", displays_to_use, max_displays);
@@ -33,16 +40,38 @@ QtState::QtState(XRDPLocalState *xrdp_local, int max_displays, bool use_dma_buf)
 		log(LOG_DEBUG, "Using %d displays\n", displays_to_use);
 	}
 
+	if (vblank_pacing) {
+		try {
+			vblank_clock = new VblankClock(x11_display());
+		} catch (const std::exception &e) {
+			log(LOG_INFO, "Can't pace frames to vblank (%s), using a frame timer.\n", e.what());
+		}
+	}
+
+	// The GL presenters need this, and xup needs to know whether we'll ask
+	// for DMA-BUF before it connects, so it's probed before both
+	if (use_dma_buf || presenter_type == PRESENTER_GL) {
+		try {
+			egl_caps = new EGLCapabilities(x11_display());
+		} catch (const std::exception &e) {
+			log(LOG_INFO, "Can't use EGL (%s).\n", e.what());
+		}
+	}
 }
 
 QtState::~QtState()
 {
-	if (egl != nullptr) {
-		delete egl;
-	}
-	if (window != nullptr) {
+	stop_dma_buf_threads();
+	// Windows release the frames they didn't paint, which may go to the
+	// vblank clock, which releases the frames waiting for a vblank
+	for (QtWindow *window : windows) {
 		delete window;
 	}
+	// Everything using the EGL display is gone
+	delete egl_caps;
+	if (vblank_clock != nullptr) {
+		delete vblank_clock;
+	}
 	delete app;
 }
 
@@ -74,26 +103,87 @@ void QtState::launch()
 	full_width = 0;
 	full_height = 0;
 
-	for (int i = 0; i < displays_to_use; i++) {
-		QScreen *screen = QGuiApplication::screens().at(i);
-		auto geometry = screen->geometry();
+	log(LOG_DEBUG, "Using the %s blit kernel\n", blit_kernel_name());
+
+	// The windows (and their framebuffers) cover exactly the monitors we
+	// tell xorgxrdp about, so parts of the session no monitor shows (e.g.
+	// next to a portrait monitor) take no memory
+	std::unique_ptr<struct display_info> display_info = get_display_info();
+	int num_displays = static_cast<int>(display_info->displays.size());
+
+	// Windows copy frames at the same time, so they split the blit threads
+	int blit_threads = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), BLIT_POOL_MAX_THREADS) / std::max(1, num_displays));
+
+	// Pace to the fastest screen, so it gets every frame
+	QtWindow *vblank_window = nullptr;
+	int vblank_refresh_rate = 0;
+
+	long framebuffer_pixels = 0;
+	for (int i = 0; i < num_displays; i++) {
+		const struct display &display = display_info->displays[i];
+		QRect geometry(display.x, display.y, display.width, display.height);
 		full_width = std::max(full_width, geometry.x() + geometry.width());
 		full_height = std::max(full_height, geometry.y() + geometry.height());
+		framebuffer_pixels += static_cast<long>(geometry.width()) * geometry.height();
 		log(LOG_DEBUG, "Display %d at %dx%d, %dx%d\n", i, geometry.x(), geometry.y(), geometry.width(), geometry.height());
-	}
 
-	log(LOG_DEBUG, "Initialized Qt with %d displays, full_width: %d, full_height: %d\n", displays_to_use, full_width, full_height);
+		QtWindow *window = new QtWindow(this, geometry, blit_threads, presenter_type, capture_format, x11_display(), egl_caps);
+		windows.push_back(window);
+		if (vblank_window == nullptr || display.refresh_rate > vblank_refresh_rate) {
+			vblank_window = window;
+			vblank_refresh_rate = display.refresh_rate;
+		}
+	}
 
-	window = new QtWindow(this, full_width, full_height);
+	log(LOG_DEBUG, "Initialized Qt with %d displays, full_width: %d, full_height: %d, framebuffers cover %ld of its %ld pixels\n", num_displays, full_width, full_height, framebuffer_pixels, static_cast<long>(full_width) * full_height);
 
-	connect(this, &QtState::paint_rects_signal, window, &QtWindow::paint_rects_slot);
+	if (vblank_clock != nullptr && vblank_window != nullptr) {
+		vblank_clock->set_window(vblank_window->winId());
+	}
 
 	// Unblock painting calls
 	app_ready_latch.count_down();
 
-	if (use_dma_buf && EGLState::is_supported(x11_display())) {
-		xrdp_local->get_xup()->request_dma_buf();
+	if (use_dma_buf && egl_caps != nullptr) {
+		if (egl_caps->dma_buf_import) {
+			// libxup has no message to offer the formats to xorgxrdp yet, so
+			// for now they're only used to turn down images we can't import
+			log(LOG_INFO, "DMA-BUF acceleration is supported by xrdp and our environment, trying to enable...\n");
+			xrdp_local->get_xup()->request_dma_buf();
+		} else {
+			log(LOG_INFO, "EGL can't import DMA-BUF images, DMA-BUF not supported.\n");
+		}
+	}
+}
+
+void QtState::release_frame(std::shared_ptr<Frame> frame)
+{
+	// Without vblank pacing, the frame is acknowledged when we drop it
+	if (vblank_clock == nullptr) {
+		return;
+	}
+
+	// Let xorgxrdp capture the next frame while this one waits for vblank, as
+	// long as that doesn't put more than frames_in_flight frames in flight
+	if (ack_credits.fetch_sub(1) > 0) {
+		frame->acknowledge();
+		frame->set_retire([this]() { ack_credits.fetch_add(1); });
+		early_acks.add(1);
+	} else {
+		ack_credits.fetch_add(1);
+		early_acks.add(0);
 	}
+	vblank_clock->release_at_vblank(std::move(frame));
+}
+
+bool QtState::is_vblank_paced()
+{
+	return vblank_clock != nullptr;
+}
+
+bool QtState::may_use_dma_buf()
+{
+	return use_dma_buf && egl_caps != nullptr && egl_caps->dma_buf_import;
 }
 
 void QtState::run()
@@ -103,15 +193,18 @@ void QtState::run()
 	log(LOG_DEBUG, "run done\n");
 }
 
-void QtState::paint_rects(int x, int y, unsigned char *data, int srcx, int srcy, int width, int height, int num_rects, xrdp_rect_spec *rects)
+void QtState::paint_frame(std::shared_ptr<Frame> frame)
 {
 	app_ready_latch.wait();
-	if (srcx != 0 || srcy != 0) {
-		throw std::runtime_error("srcx and srcy must be 0");
+
+	// Each window the frame damages gets a reference to it, and once the last
+	// of them is done with it, the frame is released. If it damages none of
+	// them, that's right away.
+	Frame *shown = frame.get();
+	std::shared_ptr<Frame> staged(shown, [this, frame](Frame *) { release_frame(frame); });
+	for (QtWindow *window : windows) {
+		window->queue_frame(staged);
 	}
-	SyncChangeReference change = SyncChangeReference(width, height, data, num_rects, rects);
-	emit paint_rects_signal(&change, x, y);
-	change.block_until_data_is_not_used();
 }
 
 void QtState::set_cursor(int x, int y, unsigned char *data, unsigned char *mask, int width, int height, int bpp)
@@ -120,7 +213,9 @@ void QtState::set_cursor(int x, int y, unsigned char *data, unsigned char *mask,
 		// Assume ARGB32 with correct alpha (which is what xorgxrdp sends when using full color cursors)
 		QImage image = QImage(reinterpret_cast<unsigned char *>(data), width, height, QImage::Format_ARGB32).mirrored(false, true);
 		QCursor cursor(QPixmap::fromImage(image), x, y);
-		window->setCursor(cursor);
+		for (QtWindow *window : windows) {
+			window->setCursor(cursor);
+		}
 		return;
 	}
 
@@ -137,7 +232,9 @@ void QtState::set_cursor(int x, int y, unsigned char *data, unsigned char *mask,
 		}
 	}
 	QCursor cursor(QPixmap::fromImage(QImage(reinterpret_cast<unsigned char *>(data_argb32), width, height, QImage::Format_ARGB32)), x, y);
-	window->setCursor(cursor);
+	for (QtWindow *window : windows) {
+		window->setCursor(cursor);
+	}
 	free(data_argb32);
 }
 
@@ -146,6 +243,11 @@ XRDPLocalState *QtState::get_xrdp_local()
 	return xrdp_local;
 }
 
+enum pixel_format QtState::get_capture_format()
+{
+	return capture_format;
+}
+
 std::unique_ptr<struct display_info> QtState::get_display_info()
 {
 	std::unique_ptr<struct display_info> display_info = std::make_unique<struct display_info>();
@@ -186,35 +288,102 @@ std::unique_ptr<struct display_info> QtState::get_display_info()
 }
 
 
-void QtState::paint_dma_buf() {
-	if (egl == nullptr) {
-		throw std::runtime_error("Can't paint using DMA-BUF: EGLState is not initialized. This is a bug.");
+void QtState::paint_dma_buf(const std::vector<QRect> *damage) {
+	if (!dma_buf_active) {
+		throw std::runtime_error("Can't paint using DMA-BUF: it isn't enabled. This is a bug.");
+	}
+	// Each monitor draws (and skips) what the damage covers on its own
+	for (EGLRenderThread *thread : egl) {
+		thread->present(damage);
+	}
+}
+
+void QtState::stop_dma_buf_threads() {
+	// The others share the first one's texture, so it goes last
+	while (!egl.empty()) {
+		delete egl.back();
+		egl.pop_back();
+	}
+}
+
+void QtState::unbind_dma_buf_threads() {
+	for (auto it = egl.rbegin(); it != egl.rend(); it++) {
+		(*it)->unbind();
 	}
-	egl->render();
 }
 
-bool QtState::enable_dma_buf(int fd, uint32_t width, uint32_t height, uint16_t stride, uint32_t size, uint32_t format) {
-	if (window == nullptr) {
-		log(LOG_ERROR, "Can't enable DMA-BUF: Qt window is not initialized. This is a bug.\n");
+bool QtState::enable_dma_buf(const struct dma_buf_image &image) {
+	if (windows.empty()) {
+		log(LOG_ERROR, "Can't enable DMA-BUF: Qt windows are not initialized. This is a bug.\n");
+		return false;
+	}
+	if (egl_caps == nullptr || !egl_caps->dma_buf_import) {
+		log(LOG_ERROR, "Can't enable DMA-BUF: EGL can't import DMA-BUF images.\n");
 		return false;
 	}
+	// Don't take the windows from the presenters for an image that's bound
+	// to fail
+	if (image.modifier != DMA_BUF_MOD_INVALID && !egl_caps->dma_buf_formats.empty()) {
+		bool supported = std::any_of(egl_caps->dma_buf_formats.begin(), egl_caps->dma_buf_formats.end(), [&image](const struct dma_buf_format &format) {
+			return format.format == image.format && format.modifier == image.modifier;
+		});
+		if (!supported) {
+			log(LOG_ERROR, "enable_dma_buf: the driver can't import format %X with modifier %" PRIX64 "\n", image.format, image.modifier);
+			return false;
+		}
+	}
 	try {
-		egl = new EGLState(x11_display(), window->winId(), fd, width, height, stride, size, format);
-		log(LOG_DEBUG, "enable_dma_buf: success\n");
-		window->set_disable_paint(true);
+		// The presenters may have their own EGL surfaces on the windows, and
+		// there can only be one per window. If DMA-BUF is enabled already,
+		// this is a new pixmap, which the render threads just switch to.
+		if (!dma_buf_active) {
+			for (QtWindow *window : windows) {
+				window->suspend_presenter();
+			}
+		}
+		// The render threads are only created the first time, after that
+		// they're kept (unbound) while DMA-BUF is disabled
+		if (egl.empty()) {
+			try {
+				for (QtWindow *window : windows) {
+					EGLRenderThread *share = egl.empty() ? nullptr : egl.front();
+					egl.push_back(new EGLRenderThread(egl_caps, static_cast<int>(window->winId()), window->get_geometry(), share));
+				}
+			} catch (...) {
+				stop_dma_buf_threads();
+				throw;
+			}
+		}
+		// The first one imports the image (or finds it in its pool), the
+		// others share its texture
+		for (EGLRenderThread *thread : egl) {
+			thread->bind(image);
+		}
+		log(LOG_DEBUG, "enable_dma_buf: success, %zu monitors\n", egl.size());
+		dma_buf_active = true;
+		for (QtWindow *window : windows) {
+			window->set_disable_paint(true);
+		}
 		return true;
 	} catch (const std::exception &e) {
 		log(LOG_ERROR, "enable_dma_buf: %s\n", e.what());
+		unbind_dma_buf_threads();
+		dma_buf_active = false;
+		for (QtWindow *window : windows) {
+			window->resume_presenter();
+			window->set_disable_paint(false);
+		}
 		return false;
 	}
 }
 
 void QtState::disable_dma_buf() {
-	if (egl != nullptr) {
-		delete egl;
-		egl = nullptr;
+	unbind_dma_buf_threads();
+	dma_buf_active = false;
+	for (QtWindow *window : windows) {
+		window->resume_presenter();
+		window->set_disable_paint(false);
 	}
-	window->set_disable_paint(false);
 }
 
 void QtState::exit()
@@ -7,11 +7,20 @@
 
 #include <QApplication>
 #include <memory>
+#include <latch>
+#include <atomic>
 
 #include "xrdp_local.h"
 #include "info.h"
+#include "frame.h"
 #include "window.h"
 #include "egl.h"
+#include "egl_thread.h"
+#include "vblank_clock.h"
+#include "stats.h"
+
+// The most frames we let xorgxrdp have in flight (captured but not yet shown)
+#define MAX_FRAMES_IN_FLIGHT 3
 
 class XRDPLocalState;
 
@@ -22,11 +31,33 @@ class QtState : public QObject
 public:
 	// max_displays can be used to limit the number of displays that are allowed
 	// The application defaults to using all available displays
-	QtState(XRDPLocalState *xrdp_local, int max_displays, bool use_dma_buf);
+	// vblank_pacing holds frame acknowledgements until the next vblank, if the
+	// X server supports it
+	// frames_in_flight (1 to MAX_FRAMES_IN_FLIGHT) is how many frames
+	// xorgxrdp may have in flight when pacing to vblank, frames beyond the
+	// first are acknowledged as soon as they're staged instead of at vblank
+	// capture_format is the pixel format we ask xorgxrdp to capture in
+	QtState(XRDPLocalState *xrdp_local, int max_displays, bool use_dma_buf, enum presenter_type presenter_type, enum pixel_format capture_format, bool vblank_pacing, int frames_in_flight);
 	~QtState();
 
 	// This is called by the xup client thread to paint screen data
-	void paint_rects(int x, int y, unsigned char *data, int srcx, int srcy, int width, int height, int num_rects, xrdp_rect_spec *rects);
+	// It queues the frame for every window it damages and returns without
+	// waiting for it to be painted.
+	void paint_frame(std::shared_ptr<Frame> frame);
+
+	// This is called once every window is done with a frame (its pixels are
+	// staged, i.e. copied out of the capture buffer) to release it. When
+	// pacing to vblank, this happens at the next vblank, unless we have
+	// credit to acknowledge it right away.
+	void release_frame(std::shared_ptr<Frame> frame);
+
+	// Whether frames are acknowledged at vblank, in which case xorgxrdp's own
+	// frame timer doesn't need to pace it
+	bool is_vblank_paced();
+
+	// Whether we'll ask xorgxrdp for DMA-BUF once launched (it may still
+	// fail to activate)
+	bool may_use_dma_buf();
 
 	// This is called by the xup client thread to set the cursor shape
 	void set_cursor(int x, int y, unsigned char *data, unsigned char *mask, int width, int height, int bpp);
@@ -45,36 +76,69 @@ public:
 
 	// Getters
 	XRDPLocalState *get_xrdp_local();
+	enum pixel_format get_capture_format();
 
 	// DMA-BUF management functions
-	bool enable_dma_buf(int fd, uint32_t width, uint32_t height, uint16_t stride, uint32_t size, uint32_t format);
+	bool enable_dma_buf(const struct dma_buf_image &image);
 	void disable_dma_buf();
-	void paint_dma_buf();
-
-signals:
-	// Used to trigger QtWindow::paint_rect_slot
-	void paint_rects_signal(SyncChangeReference *change, int x, int y);
+	// Display the DMA-BUF pixmap, damage is what changed in it since the last
+	// paint (in session coordinates), or null if that's unknown
+	// This returns without waiting for the pixmap to be drawn, let alone
+	// shown.
+	void paint_dma_buf(const std::vector<QRect> *damage = nullptr);
 
 private:
 	char *x11_display();
 
+	// Destroy the DMA-BUF render threads, if any
+	void stop_dma_buf_threads();
+
+	// Unbind the DMA-BUF render threads from their image, which releases
+	// their surfaces on the windows
+	void unbind_dma_buf_threads();
+
 	// The maximum number of displays to use
 	int max_displays;
 	int displays_to_use;
 	bool use_dma_buf;
 
-	// The width and height of the rectangle that contains all screens
+	// How the CPU framebuffer is put on the screen
+	enum presenter_type presenter_type;
+
+	// The pixel format of the frames xorgxrdp sends
+	enum pixel_format capture_format;
+
+	// The width and height of the rectangle that contains all screens (the
+	// size of the session), only the screens themselves have framebuffers
 	int full_width;
 	int full_height;
 
 	// The Qt application
 	QApplication *app;
 
-	// The main window that shows all displays
-	QtWindow *window;
-
-	// The EGL state for the window, if DMA-BUF is enabled
-	EGLState *egl = nullptr;
+	// The windows showing each display
+	std::vector<QtWindow *> windows;
+
+	// Display the DMA-BUF pixmap on each window, the first one imports it
+	// and the others share its texture. They're created the first time
+	// DMA-BUF is enabled, and kept for when it's enabled again.
+	std::vector<EGLRenderThread *> egl;
+	bool dma_buf_active = false;
+
+	// What EGL can do on the display, probed once in launch if DMA-BUF or
+	// the GL presenter may use it, and kept (with the display initialized)
+	// for every DMA-BUF activation. Null if EGL can't be used.
+	EGLCapabilities *egl_caps = nullptr;
+
+	// Releases presented frames at vblank, if vblank pacing is enabled and
+	// supported
+	VblankClock *vblank_clock = nullptr;
+
+	// Number of frames we may still acknowledge before they're shown, each
+	// frame acknowledged early takes one and returns it when it's retired at
+	// vblank
+	std::atomic<int> ack_credits;
+	StatCounter early_acks;
 
 	// The global state of the application
 	XRDPLocalState *xrdp_local;
@@ -0,0 +1,160 @@
+#include <cstdlib>
+#include <stdexcept>
+
+#include "common.h"
+#include "vblank_clock.h"
+
+// Intervals spanning more vblanks than this are idle gaps, not frame time
+// jitter, so they're left out of the statistics
+#define VBLANK_CLOCK_MAX_COUNTED_VBLANKS 8
+
+VblankClock::VblankClock(const char *x11_display) :
+	frame_interval("vblank paced frame interval", "us", STATS_LOG_EVERY),
+	vblank_wait("frame wait for vblank", "us", STATS_LOG_EVERY)
+{
+	connection = xcb_connect(x11_display, nullptr);
+	if (xcb_connection_has_error(connection)) {
+		xcb_disconnect(connection);
+		throw std::runtime_error("xcb_connect failed");
+	}
+
+	const xcb_query_extension_reply_t *present_extension = xcb_get_extension_data(connection, &xcb_present_id);
+	if (present_extension == nullptr || !present_extension->present) {
+		xcb_disconnect(connection);
+		throw std::runtime_error("the Present extension is not supported by the X server");
+	}
+	present_opcode = present_extension->major_opcode;
+
+	// Until we have a window, the server picks the CRTC for the root window
+	select_window(xcb_setup_roots_iterator(xcb_get_setup(connection)).data->root);
+
+	thread = std::thread(&VblankClock::thread_func, this);
+}
+
+VblankClock::~VblankClock() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	frames_pending.notify_one();
+	thread.join();
+	xcb_disconnect(connection);
+}
+
+void VblankClock::select_window(xcb_window_t new_window) {
+	// Otherwise both selections deliver every completion event. The old
+	// window may already be destroyed (which drops its selection anyway),
+	// so the error is checked here instead of reaching wait_for_msc.
+	if (event_id != 0) {
+		xcb_void_cookie_t cookie = xcb_present_select_input_checked(connection, event_id, window, XCB_PRESENT_EVENT_MASK_NO_EVENT);
+		free(xcb_request_check(connection, cookie));
+	}
+	window = new_window;
+	event_id = xcb_generate_id(connection);
+	xcb_present_select_input(connection, event_id, window, XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+	xcb_flush(connection);
+}
+
+void VblankClock::set_window(WId window_id) {
+	std::lock_guard<std::mutex> lock(mutex);
+	select_window(static_cast<xcb_window_t>(window_id));
+}
+
+void VblankClock::release_at_vblank(std::shared_ptr<Frame> frame) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!broken && running) {
+			if (frames.empty()) {
+				oldest_frame_time = std::chrono::steady_clock::now();
+			}
+			frames.push_back(std::move(frame));
+		}
+	}
+	// If we didn't take the frame, it's released when we return
+	frames_pending.notify_one();
+}
+
+bool VblankClock::wait_for_msc(uint32_t serial, uint64_t *ust, uint64_t *msc) {
+	while (true) {
+		xcb_generic_event_t *event = xcb_wait_for_event(connection);
+		if (event == nullptr) {
+			log(LOG_WARN, "VblankClock: the X connection was closed\n");
+			return false;
+		}
+		if (event->response_type == 0) {
+			xcb_generic_error_t *error = reinterpret_cast<xcb_generic_error_t *>(event);
+			log(LOG_WARN, "VblankClock: X error %d (request %d.%d)\n", error->error_code, error->major_code, error->minor_code);
+			free(event);
+			return false;
+		}
+		if ((event->response_type & 0x7f) == XCB_GE_GENERIC) {
+			xcb_ge_generic_event_t *generic = reinterpret_cast<xcb_ge_generic_event_t *>(event);
+			if (generic->extension == present_opcode && generic->event_type == XCB_PRESENT_COMPLETE_NOTIFY) {
+				xcb_present_complete_notify_event_t *complete = reinterpret_cast<xcb_present_complete_notify_event_t *>(event);
+				if (complete->kind == XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC && complete->serial == serial) {
+					*ust = complete->ust;
+					*msc = complete->msc;
+					free(event);
+					return true;
+				}
+			}
+		}
+		free(event);
+	}
+}
+
+void VblankClock::thread_func() {
+	uint32_t serial = 0;
+	std::vector<std::shared_ptr<Frame>> presented;
+
+	while (true) {
+		xcb_window_t target;
+		std::chrono::steady_clock::time_point frame_time;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frames_pending.wait(lock, [this] { return !frames.empty() || !running; });
+			if (!running) {
+				break;
+			}
+			target = window;
+			frame_time = oldest_frame_time;
+		}
+
+		// Ask for an event at the next vblank (the next MSC that's a multiple
+		// of 1)
+		serial++;
+		xcb_present_notify_msc(connection, target, serial, 0, 1, 0);
+		xcb_flush(connection);
+
+		uint64_t ust = 0;
+		uint64_t msc = 0;
+		bool ok = wait_for_msc(serial, &ust, &msc);
+
+		// Frames presented while we waited are released at this vblank too,
+		// they were presented before it
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			presented.swap(frames);
+			if (!ok) {
+				log(LOG_WARN, "VblankClock: waiting for vblanks failed, acknowledging frames right away from now on\n");
+				broken = true;
+			}
+		}
+		presented.clear();
+
+		vblank_wait.add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - frame_time).count());
+		if (ok && last_msc != 0 && msc > last_msc && msc - last_msc <= VBLANK_CLOCK_MAX_COUNTED_VBLANKS) {
+			frame_interval.add(ust - last_ust);
+		}
+		last_ust = ust;
+		last_msc = msc;
+
+		if (!ok) {
+			break;
+		}
+	}
+
+	// Release anything left
+	std::lock_guard<std::mutex> lock(mutex);
+	frames.clear();
+}
@@ -0,0 +1,83 @@
+#ifndef QT_VBLANK_CLOCK_H
+#define QT_VBLANK_CLOCK_H
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+#include <QWidget>
+
+#include "frame.h"
+#include "stats.h"
+
+// Paces xorgxrdp to the vblank of the display we show the session on.
+// xorgxrdp doesn't capture a new frame before the previous one is
+// acknowledged, so instead of acknowledging frames as soon as they're
+// presented, we hold them until the next vblank (using the Present
+// extension's NotifyMSC). This locks xorgxrdp's frame rate to scanout, so it
+// doesn't capture frames that would never be seen.
+//
+// We use our own X connection and thread, so waiting for vblanks doesn't
+// block the Qt thread.
+class VblankClock {
+public:
+	// Throws std::runtime_error if the Present extension isn't available
+	VblankClock(const char *x11_display);
+	~VblankClock();
+
+	VblankClock(const VblankClock &) = delete;
+	VblankClock &operator=(const VblankClock &) = delete;
+
+	// Use the vblank of the CRTC the window is on, until this is called the
+	// root window is used
+	void set_window(WId window_id);
+
+	// Release a presented frame (which acknowledges it) at the next vblank
+	void release_at_vblank(std::shared_ptr<Frame> frame);
+
+private:
+	void thread_func();
+
+	// Wait for the completion event of the NotifyMSC request with the given
+	// serial and get the UST (in microseconds) and MSC of the vblank, returns
+	// false if the request failed
+	bool wait_for_msc(uint32_t serial, uint64_t *ust, uint64_t *msc);
+
+	// Select Present completion events on a window instead of the current
+	// one, with the lock held
+	void select_window(xcb_window_t new_window);
+
+	xcb_connection_t *connection = nullptr;
+	uint8_t present_opcode = 0;
+	xcb_present_event_t event_id = 0;
+
+	std::mutex mutex;
+	std::condition_variable frames_pending;
+	xcb_window_t window = 0;
+	std::vector<std::shared_ptr<Frame>> frames;
+	bool running = true;
+
+	// When the oldest frame in frames was added
+	std::chrono::steady_clock::time_point oldest_frame_time;
+
+	// Set if waiting for vblanks failed, frames are released right away from
+	// then on
+	bool broken = false;
+
+	std::thread thread;
+
+	// The last vblank we released frames at
+	uint64_t last_ust = 0;
+	uint64_t last_msc = 0;
+
+	// Time between consecutive vblanks we released frames at (its stddev is
+	// the frame time jitter), and time frames waited for a vblank
+	StatCounter frame_interval;
+	StatCounter vblank_wait;
+};
+
+#endif
@@ -1,108 +1,348 @@
+#include <future>
+
 #include "common.h"
 #include "info.h"
 #include "window.h"
 #include "state.h"
+#include "blit.h"
+#include "blit_pool.h"
 
-SyncChangeReference::SyncChangeReference(int width, int height, unsigned char *input_data, int num_rects, xrdp_rect_spec *rects) : release_latch(1)
-{
-	this->width = width;
-	this->height = height;
-	this->num_rects = num_rects;
-	this->data = input_data;
-	this->rects = rects;
-}
+// There are at most MAX_FRAMES_IN_FLIGHT frames in flight at a time (xorgxrdp
+// waits for frames to be acknowledged before sending more), this just leaves
+// some slack.
+#define FRAME_QUEUE_CAPACITY (MAX_FRAMES_IN_FLIGHT + 1)
 
-SyncChangeReference::~SyncChangeReference()
+QtWindow::QtWindow(QtState *QtState, const QRect &geometry, int blit_threads, enum presenter_type presenter_type, enum pixel_format capture_format, const char *x11_display, const EGLCapabilities *egl_caps) :
+	frames(FRAME_QUEUE_CAPACITY),
+	blit_pool(blit_threads),
+	scroll_detector(pixel_format_bytes(capture_format)),
+	damaged_pixels("damaged pixels per frame", "pixels", STATS_LOG_EVERY),
+	scrolled_pixels("pixels moved on screen instead of presented", "pixels", STATS_LOG_EVERY)
 {
+	this->qt = QtState;
+	this->geometry = geometry;
+	this->capture_format = capture_format;
+
+	// Make sure the window manager doesn't try to resize us.
+	// This is only revelant for debugging, in production there's no window
+	// manager so a regular resize would work too.
+	setFixedSize(geometry.width(), geometry.height());
+
+	// We want to get mouseMove events
+	setMouseTracking(true);
+
+	// Cover our screen, frameless
+	move(geometry.x(), geometry.y());
+	setWindowFlags(Qt::FramelessWindowHint);
+
+	// Create the native window now, presenters that paint on it directly need
+	// it
+	winId();
+	presenter = create_presenter(presenter_type, x11_display, egl_caps, this, geometry, capture_format, [this]() {
+		qt->get_xrdp_local()->get_xup()->request_full_refresh();
+	});
+	log(LOG_DEBUG, "Using the %s presenter for the screen at %dx%d\n", presenter->get_name(), geometry.x(), geometry.y());
+	blit = blit_rect_func_for(presenter->get_framebuffer_format(), capture_format);
+	if (presenter->paints_on_screen()) {
+		setAttribute(Qt::WA_PaintOnScreen);
+		setAttribute(Qt::WA_NoSystemBackground);
+		render_thread = std::thread(&QtWindow::render_thread_func, this);
+	} else {
+		connect(this, &QtWindow::frames_ready_signal, this, &QtWindow::paint_frames_slot);
+	}
+
+	// Finally, show the window.
+	show();
 }
 
-void SyncChangeReference::signal_data_is_not_used()
-{
-	release_latch.count_down();
+QtWindow::~QtWindow() {
+	// Release any frames that weren't painted
+	frames.close();
+	if (render_thread.joinable()) {
+		render_thread.join();
+	}
+	delete presenter;
 }
 
-void SyncChangeReference::block_until_data_is_not_used()
+const QRect &QtWindow::get_geometry()
 {
-	release_latch.wait();
+	return geometry;
 }
 
-unsigned char *SyncChangeReference::get_data()
+bool QtWindow::queue_frame(std::shared_ptr<Frame> frame)
 {
-	return data;
+	QRect clip = geometry.intersected(QRect(0, 0, frame->get_width(), frame->get_height()));
+	bool damaged = false;
+	for (const xrdp_rect_spec &rect : frame->get_rects()) {
+		if (QRect(rect.x, rect.y, rect.cx, rect.cy).intersects(clip)) {
+			damaged = true;
+			break;
+		}
+	}
+	if (!damaged) {
+		return false;
+	}
+
+	frames.push(std::move(frame));
+	if (!render_thread.joinable()) {
+		emit frames_ready_signal();
+	}
+	return true;
 }
 
-xrdp_rect_spec *SyncChangeReference::get_rects()
+void QtWindow::paint_frames_slot()
 {
-	return rects;
+	paint_frames();
 }
 
-int SyncChangeReference::get_num_rects()
+void QtWindow::render_thread_func()
 {
-	return num_rects;
+	while (frames.wait()) {
+		std::vector<std::function<void()>> tasks;
+		QRegion expose;
+		bool disabled;
+		{
+			std::lock_guard<std::mutex> lock(render_mutex);
+			tasks.swap(render_tasks);
+			expose = render_expose;
+			render_expose = QRegion();
+			disabled = paint_disabled;
+		}
+
+		try {
+			for (std::function<void()> &task : tasks) {
+				task();
+			}
+			if (!expose.isEmpty() && !disabled) {
+				presenter->expose(expose);
+			}
+		} catch (const std::exception &e) {
+			log(LOG_ERROR, "render_thread_func caught exception: %s\n", e.what());
+			QMetaObject::invokeMethod(this, [this]() { qt->exit(); }, Qt::QueuedConnection);
+		}
+		paint_frames();
+	}
+
+	// Nobody runs tasks queued from now on but their callers, run the ones
+	// that came in while we stopped
+	std::vector<std::function<void()>> tasks;
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		render_stopped = true;
+		tasks.swap(render_tasks);
+	}
+	for (std::function<void()> &task : tasks) {
+		task();
+	}
 }
 
-int SyncChangeReference::get_width()
+void QtWindow::run_on_render_thread(std::function<void()> task, bool wait)
 {
-	return width;
+	if (!render_thread.joinable()) {
+		// Qt's event loop can't carry exceptions, so the task's are caught
+		// in the Qt thread and rethrown here when waiting, or handled like
+		// the render thread's otherwise
+		if (!wait) {
+			QMetaObject::invokeMethod(this, [this, task]() {
+				try {
+					task();
+				} catch (const std::exception &e) {
+					log(LOG_ERROR, "run_on_render_thread caught exception: %s\n", e.what());
+					qt->exit();
+				}
+			}, Qt::QueuedConnection);
+			return;
+		}
+		std::exception_ptr error;
+		// This is never called from the Qt thread, so blocking is safe
+		QMetaObject::invokeMethod(this, [&task, &error]() {
+			try {
+				task();
+			} catch (...) {
+				error = std::current_exception();
+			}
+		}, Qt::BlockingQueuedConnection);
+		if (error != nullptr) {
+			std::rethrow_exception(error);
+		}
+		return;
+	}
+
+	std::promise<void> done;
+	std::future<void> done_future = done.get_future();
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		if (!render_stopped) {
+			if (wait) {
+				render_tasks.push_back([&task, &done]() {
+					try {
+						task();
+					} catch (...) {
+						done.set_exception(std::current_exception());
+						return;
+					}
+					done.set_value();
+				});
+			} else {
+				render_tasks.push_back(task);
+			}
+			queued = true;
+		}
+	}
+	if (!queued) {
+		// The render thread is gone
+		task();
+		return;
+	}
+	frames.wake();
+	if (wait) {
+		// Rethrows what the task threw
+		done_future.get();
+	}
 }
 
-int SyncChangeReference::get_height()
+void QtWindow::paint_frames()
 {
-	return height;
+	// Frames are released (and acknowledged to xorgxrdp) as soon as the last
+	// window painting them is done with them, which is at the next vblank
+	// when pacing to vblank
+	std::shared_ptr<Frame> frame;
+	while ((frame = frames.pop()) != nullptr) {
+		try {
+			paint_frame(std::move(frame));
+		} catch (const std::exception &e) {
+			log(LOG_ERROR, "paint_frames caught exception: %s\n", e.what());
+			QMetaObject::invokeMethod(this, [this]() { qt->exit(); }, Qt::QueuedConnection);
+		}
+	}
 }
 
-QtWindow::QtWindow(QtState *QtState, int width, int height)
+void QtWindow::paint_frame(std::shared_ptr<Frame> frame)
 {
-	this->qt = QtState;
-	framebuffer = QImage(width, height, QImage::Format_RGB32);
+	presenter->begin_update(frame);
+	const std::vector<xrdp_rect_spec> &rects = frame->get_rects();
 
-	// Make sure the window manager doesn't try to resize us.
-	// This is only revelant for debugging, in production there's no window
-	// manager so a regular resize would work too.
-	setFixedSize(width, height);
+	// The part of the frame we show, in session coordinates, everything we
+	// hand to the presenter is relative to our origin
+	QRect clip = geometry.intersected(QRect(0, 0, frame->get_width(), frame->get_height()));
+	QPoint origin = geometry.topLeft();
+	blit_rects.clear();
+	for (const xrdp_rect_spec &rect : rects) {
+		QRect qrect = QRect(rect.x, rect.y, rect.cx, rect.cy).intersected(clip).translated(-origin);
+		if (qrect.isEmpty()) {
+			continue;
+		}
+		blit_rects.push_back({ .x = qrect.x(), .y = qrect.y(), .cx = qrect.width(), .cy = qrect.height() });
+	}
 
-	// We want to get mouseMove events
-	setMouseTracking(true);
+	// Merge overlapping and touching rects, and cover fragmented damage
+	// with fewer, bigger rects where that's cheaper
+	damage.set(blit_rects);
+	const std::vector<blit_rect_spec> &damage_rects = damage.get_rects();
+	damaged_pixels.add(damage.get_area());
 
-	// We can't be full screen because then our window is just on one screen,
-	// so we're frameless at 0x0.
-	move(0, 0);
-	setWindowFlags(Qt::FramelessWindowHint);
+	// Only repaint what was damaged, so small changes (like a blinking cursor)
+	// don't repaint the entire window. DamageRegion's cost model already
+	// counts presenting each rect, and picks the bounding rect when that's
+	// cheaper.
+	QRegion region;
+	for (const blit_rect_spec &rect : damage_rects) {
+		region += QRect(rect.x, rect.y, rect.cx, rect.cy);
+	}
 
-	// Finally, show the window.
-	show();
-}
+	// When the framebuffer is in the capture format (always, unless the
+	// presenter's framebuffer can only be 32 bit) this is a plain copy of
+	// each rect's rows, otherwise the pixels are converted on the way
+	scrolls.clear();
+	if (presenter->copies_frames()) {
+		QImage *framebuffer = presenter->get_framebuffer();
+		if (framebuffer->isNull()) {
+			// The presenter is suspended, DMA-BUF has the window
+			return;
+		}
+		if (!damage_rects.empty()) {
+			int bytes_per_pixel = pixel_format_bytes(capture_format);
+			size_t src_stride = static_cast<size_t>(frame->get_width()) * bytes_per_pixel;
+			const uint8_t *src = frame->get_data() + origin.y() * src_stride + origin.x() * bytes_per_pixel;
 
-QtWindow::~QtWindow() {
-}
+			// Rects whose contents just moved are moved on screen, and only
+			// their rows that are actually new are presented. The whole rect
+			// is still copied into the framebuffer, which is as fast as
+			// moving it there.
+			if (presenter->supports_scroll()) {
+				// The framebuffer's rows can only be compared with the
+				// frame's in the same format
+				const uint8_t *old = presenter->get_framebuffer_format() == capture_format ? framebuffer->bits() : nullptr;
+				long scrolled = 0;
+				for (const blit_rect_spec &rect : damage_rects) {
+					int dy = scroll_detector.detect(old, framebuffer->bytesPerLine(), src, src_stride, rect);
+					if (dy == 0) {
+						continue;
+					}
+					QRect qrect(rect.x, rect.y, rect.cx, rect.cy);
+					scrolls.push_back({ qrect, dy });
+					region -= qrect;
+					for (const blit_rect_spec &row : scroll_detector.get_new_rows()) {
+						region += QRect(row.x, row.y, row.cx, row.cy);
+					}
+					scrolled += static_cast<long>(rect.cx) * (rect.cy - std::abs(dy));
+				}
+				scrolled_pixels.add(scrolled);
+			}
 
-void QtWindow::paint_rects_slot(SyncChangeReference *change, int x, int y)
-{
-	try {
-		QPainter painter(&this->framebuffer);
-		QImage new_image(change->get_data(), change->get_width(), change->get_height(), QImage::Format_RGB32);
-		int num_rects = change->get_num_rects();
-		for (int i = 0; i < num_rects; i++) {
-			xrdp_rect_spec *rect = &change->get_rects()[i];
-			painter.drawImage(QRect(rect->x, rect->y, rect->cx, rect->cy), new_image, QRect(rect->x, rect->y, rect->cx, rect->cy));
+			blit_pool.blit_rects(blit, framebuffer->bits(), framebuffer->bytesPerLine(), src, src_stride, pixel_format_bytes(presenter->get_framebuffer_format()), damage_rects);
 		}
-		update();
-	} catch (const std::exception &e) {
-		log(LOG_ERROR, "paint_rect_slot caught exception: %s\n", e.what());
-		qt->exit();
 	}
-	change->signal_data_is_not_used();
+	// Our pixels are staged (or the presenter holds the frame until it has
+	// read them), so xorgxrdp can go on while we present
+	frame.reset();
+
+	for (const std::pair<QRect, int> &scroll : scrolls) {
+		presenter->scroll(scroll.first, scroll.second);
+	}
+	presenter->present(region);
 }
 
 void QtWindow::paintEvent(QPaintEvent *event) {
-	QPainter painter(this);
-	painter.drawImage(event->rect(), framebuffer, event->rect());
+	if (render_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(render_mutex);
+			render_expose += event->region();
+		}
+		frames.wake();
+		return;
+	}
+	presenter->expose(event->region());
+}
+
+QPaintEngine *QtWindow::paintEngine() const {
+	if (presenter != nullptr && presenter->paints_on_screen()) {
+		return nullptr;
+	}
+	return QWidget::paintEngine();
 }
 
 void QtWindow::set_disable_paint(bool disable_paint) {
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		paint_disabled = disable_paint;
+	}
 	setUpdatesEnabled(!disable_paint);
 }
 
+void QtWindow::suspend_presenter() {
+	run_on_render_thread([this]() { presenter->suspend(); }, true);
+}
+
+void QtWindow::resume_presenter() {
+	run_on_render_thread([this]() {
+		presenter->resume();
+		// The framebuffer was replaced
+		scroll_detector.reset();
+	}, false);
+}
+
 int QtWindow::qt_mouse_button_to_xrdp_mouse_button(Qt::MouseButton button) {
 	switch (button) {
 		case Qt::LeftButton:
@@ -127,7 +367,7 @@ void QtWindow::mousePressEvent(QMouseEvent *event) {
 	}
 
 	log(LOG_DEBUG, "mousePressEvent: %d, %d, qt=%d x=%d\n", event->position().x(), event->position().y(), event->button(), x_button);
-	qt->get_xrdp_local()->get_xup()->event_mouse_down(event->position().x(), event->position().y(), x_button);
+	qt->get_xrdp_local()->get_xup()->event_mouse_down(geometry.x() + event->position().x(), geometry.y() + event->position().y(), x_button);
 }
 
 void QtWindow::mouseReleaseEvent(QMouseEvent *event) {
@@ -138,21 +378,21 @@ void QtWindow::mouseReleaseEvent(QMouseEvent *event) {
 	}
 
 	log(LOG_DEBUG, "mouseReleaseEvent: %d, %d, qt=%d x=%d\n", event->position().x(), event->position().y(), event->button(), x_button);
-	qt->get_xrdp_local()->get_xup()->event_mouse_up(event->position().x(), event->position().y(), x_button);
+	qt->get_xrdp_local()->get_xup()->event_mouse_up(geometry.x() + event->position().x(), geometry.y() + event->position().y(), x_button);
 }
 
 void QtWindow::mouseMoveEvent(QMouseEvent *event) {
 	log(LOG_DEBUG, "mouseMoveEvent: %d, %d\n", event->position().x(), event->position().y());
-	qt->get_xrdp_local()->get_xup()->event_mouse_move(event->position().x(), event->position().y());
+	qt->get_xrdp_local()->get_xup()->event_mouse_move(geometry.x() + event->position().x(), geometry.y() + event->position().y());
 }
 
 void QtWindow::wheelEvent(QWheelEvent *event) {
 	log(LOG_DEBUG, "wheelEvent: %d, %d, %d, %d\n", event->position().x(), event->position().y(), event->pixelDelta().x(), event->pixelDelta().y());
 	if (event->pixelDelta().y() != 0) {
-		qt->get_xrdp_local()->get_xup()->event_scroll_vertical(event->position().x(), event->position().y(), event->pixelDelta().y() > 0 ? 1 : -1);
+		qt->get_xrdp_local()->get_xup()->event_scroll_vertical(geometry.x() + event->position().x(), geometry.y() + event->position().y(), event->pixelDelta().y() > 0 ? 1 : -1);
 	}
 	if (event->pixelDelta().x() != 0) {
-		qt->get_xrdp_local()->get_xup()->event_scroll_horizontal(event->position().x(), event->position().y(), event->pixelDelta().x() > 0 ? 1 : -1);
+		qt->get_xrdp_local()->get_xup()->event_scroll_horizontal(geometry.x() + event->position().x(), geometry.y() + event->position().y(), event->pixelDelta().x() > 0 ? 1 : -1);
 	}
 }
 
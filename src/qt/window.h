@@ -1,7 +1,6 @@
 #ifndef QT_WINDOW_H
 #define QT_WINDOW_H
 
-#include <latch>
 #include <QWidget>
 #include <QObject>
 #include <QThread>
@@ -11,69 +10,70 @@
 #include <QPaintEvent>
 #include <QMouseEvent>
 #include <QWheelEvent>
+#include <mutex>
+#include <thread>
+#include <functional>
 
-class QtState;
-
-// Used to move screen data between the xup client thread and the qt thread
-// The xup client thread will create a SyncChangeReference object and hand it
-// to the qt thread, the destructor blocks so the xup client thread can wait
-// for the qt thread to finish processing the data.
-class SyncChangeReference{
-public:
-	// These are the raw values from the xup client thread
-	SyncChangeReference(int width, int height, unsigned char *data, int num_rects, xrdp_rect_spec *rects);
-
-	// The destructor blocks until a call to signal_data_is_not_used
-	~SyncChangeReference();
+#include "frame.h"
+#include "stats.h"
+#include "blit_pool.h"
+#include "damage.h"
+#include "scroll.h"
+#include "presenter.h"
 
-	// Getters
-	unsigned char *get_data();
-	xrdp_rect_spec *get_rects();
-	int get_num_rects();
-	int get_width();
-	int get_height();
-
-	// Signal that the data is no longer needed
-	void signal_data_is_not_used();
-	void block_until_data_is_not_used();
-
-private:
-	unsigned char *data;
-	int num_rects;
-	xrdp_rect_spec *rects;
-	int width;
-	int height;
-
-	// This latch is used to prevent SyncChangeReference from never being
-	// freed (by the paint_rect_signal leading to nowhere before the app is
-	// properly initialized), which causes hangs.
-	std::latch release_latch;
-};
+class QtState;
 
-// This is the main window that displays all screens
-// There is just one and it's as big as the theoretical rectangle that contains
-// all screens.
+// A window showing one screen
+// There's one per screen, each showing the part of the session at the
+// screen's geometry with its own presenter and framebuffer.
+//
+// Presenters that paint on screen by themselves are driven by a render thread
+// of the window's own, so a slow screen (or one waiting for its vblank)
+// doesn't hold up the others. Presenters that paint through Qt have to be
+// used from the Qt thread, so their frames are painted by paint_frames_slot.
 class QtWindow : public QWidget
 {
 	Q_OBJECT
 
+signals:
+	// Emitted by queue_frame when the window has no render thread, to paint
+	// the frame in the Qt thread
+	void frames_ready_signal();
+
 public slots:
-	// This is called by the QtState thread to paint a rectangle.
-	// It's connected to QtState::paint_rect_signal and used to allow the
-	// xup thread to paint a rectangle.
-	// When using DMA-BUF, this is skipped and paint_dma_buf (which calls
-	// EGLState::render) is used instead.
-	void paint_rects_slot(SyncChangeReference *change, int x, int y);
+	// This is called in the Qt thread to paint the frames queued by the xup
+	// client thread, when the window has no render thread.
+	// When using DMA-BUF, this is skipped and QtState::paint_dma_buf (which
+	// has EGLRenderThread call EGLState::render) is used instead.
+	void paint_frames_slot();
 
 public:
-	QtWindow(QtState *QtState, int width, int height);
+	// geometry is the screen's geometry, which is also the part of the
+	// session the window shows
+	// blit_threads is the number of threads used to copy frames into the
+	// framebuffer
+	// capture_format is the pixel format of the frames
+	// egl_caps is what EGL can do on the display, or null if it can't be used
+	QtWindow(QtState *QtState, const QRect &geometry, int blit_threads, enum presenter_type presenter_type, enum pixel_format capture_format, const char *x11_display, const EGLCapabilities *egl_caps);
 	~QtWindow();
 
+	// Queue a frame to be painted, called by the xup client thread
+	// Returns false (without queueing it) if none of the frame's damage is
+	// on this window.
+	bool queue_frame(std::shared_ptr<Frame> frame);
+
+	const QRect &get_geometry();
+
 	// Overriden QtWidget events
 
-	// Called when paint_rect_slot calls QWidget::update
+	// Called when the presenter calls QWidget::update, or when X11 asks us
+	// to redraw part of the window
 	void paintEvent(QPaintEvent *event);
 
+	// Returns nullptr when the presenter paints the window by itself, so Qt
+	// doesn't paint over it
+	QPaintEngine *paintEngine() const override;
+
 	// Mouse events
 	void mousePressEvent(QMouseEvent *event);
 	void mouseReleaseEvent(QMouseEvent *event);
@@ -86,13 +86,74 @@ public:
 
 	void set_disable_paint(bool disable_paint);
 
+	// Let DMA-BUF take over the window and give it back, called from the xup
+	// client thread. suspend_presenter returns once the presenter is
+	// suspended, resume_presenter doesn't wait.
+	void suspend_presenter();
+	void resume_presenter();
+
 private:
 	QtState *qt;
 
-	// This is the actual framebuffer of the screens
-	// We need to keep it in RAM because X11 sometimes asks applications to
-	// redraw parts of themselves when not using compositing
-	QImage framebuffer;
+	// The part of the session we show, in session coordinates
+	QRect geometry;
+
+	// Puts the framebuffer on the screen
+	// The presenter owns the actual framebuffer of the screen (in RAM or in
+	// a GL texture), which we need to keep because X11 sometimes asks
+	// applications to redraw parts of themselves when not using compositing
+	Presenter *presenter = nullptr;
+
+	// Frames waiting to be painted
+	FrameQueue frames;
+
+	// Pop and paint all queued frames
+	void paint_frames();
+
+	// Copy the damaged rects of a frame to the framebuffer and present them,
+	// the frame is released as soon as its pixels are staged
+	void paint_frame(std::shared_ptr<Frame> frame);
+
+	// The render thread, if the presenter paints on screen
+	// It sleeps on the frame queue, and is woken up for frames, tasks from
+	// other threads, and regions X11 asked us to redraw.
+	void render_thread_func();
+	std::thread render_thread;
+
+	// Run a function on the render thread (or on the Qt thread if we have no
+	// render thread), optionally waiting for it to finish (in which case
+	// what it throws is rethrown)
+	void run_on_render_thread(std::function<void()> task, bool wait);
+
+	// Work for the render thread, protected by render_mutex
+	std::mutex render_mutex;
+	std::vector<std::function<void()>> render_tasks;
+	QRegion render_expose;
+	bool render_stopped = false;
+	bool paint_disabled = false;
+
+	// The pixel format of the frames, and the copy converting them to the
+	// presenter's framebuffer, picked once when the presenter is created
+	enum pixel_format capture_format;
+	blit_rect_func blit;
+
+	// Splits large copies to the framebuffer across multiple threads
+	BlitPool blit_pool;
+
+	// The damaged rects of the frame being painted, and what's actually
+	// copied and presented for them, kept to avoid reallocating
+	std::vector<blit_rect_spec> blit_rects;
+	DamageRegion damage;
+
+	// Finds damaged rects whose contents just moved, and the moves to do on
+	// screen for the frame being painted
+	ScrollDetector scroll_detector;
+	std::vector<std::pair<QRect, int>> scrolls;
+
+	// Counter of pixels damaged by xorgxrdp (the presenter counts the pixels
+	// it actually presents)
+	StatCounter damaged_pixels;
+	StatCounter scrolled_pixels;
 
 	// This is used to map Qt mouse buttons to xrdp mouse buttons
 	int qt_mouse_button_to_xrdp_mouse_button(Qt::MouseButton button);
@@ -0,0 +1,250 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "common.h"
+#include "xshm_presenter.h"
+#include "framebuffer.h"
+
+XShmPresenter::XShmPresenter(const char *x11_display, WId window_id, int width, int height) {
+	window = static_cast<xcb_window_t>(window_id);
+	this->width = width;
+	this->height = height;
+
+	connection = xcb_connect(x11_display, nullptr);
+	if (xcb_connection_has_error(connection)) {
+		cleanup();
+		throw std::runtime_error("xcb_connect failed");
+	}
+
+	const xcb_query_extension_reply_t *shm_extension = xcb_get_extension_data(connection, &xcb_shm_id);
+	if (shm_extension == nullptr || !shm_extension->present) {
+		cleanup();
+		throw std::runtime_error("MIT-SHM is not supported by the X server");
+	}
+	completion_event_type = shm_extension->first_event + XCB_SHM_COMPLETION;
+
+	// QImage::Format_RGB32 is only the same as the X server's 24 bit ZPixmap
+	// format on little endian servers with 32 bits per pixel
+	const xcb_setup_t *setup = xcb_get_setup(connection);
+	if (setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST) {
+		cleanup();
+		throw std::runtime_error("the X server isn't little endian");
+	}
+
+	xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(connection, xcb_get_geometry(connection, window), nullptr);
+	if (geometry == nullptr) {
+		cleanup();
+		throw std::runtime_error("xcb_get_geometry failed");
+	}
+	depth = geometry->depth;
+	free(geometry);
+
+	bool format_found = false;
+	for (auto formats = xcb_setup_pixmap_formats_iterator(setup); formats.rem; xcb_format_next(&formats)) {
+		if (formats.data->depth == depth && formats.data->bits_per_pixel == 32) {
+			format_found = true;
+		}
+	}
+	if (!format_found || (depth != 24 && depth != 32)) {
+		cleanup();
+		throw std::runtime_error("the window doesn't use a 32 bits per pixel format");
+	}
+
+	// Our windows are never covered (there's no window manager in
+	// production), so CopyArea never needs us to repaint its source
+	gc = xcb_generate_id(connection);
+	uint32_t graphics_exposures = 0;
+	xcb_create_gc(connection, gc, window, XCB_GC_GRAPHICS_EXPOSURES, &graphics_exposures);
+
+	try {
+		create_segment();
+	} catch (...) {
+		cleanup();
+		throw;
+	}
+
+	log(LOG_INFO, "Using the MIT-SHM presenter.\n");
+}
+
+XShmPresenter::~XShmPresenter() {
+	cleanup();
+}
+
+void XShmPresenter::cleanup() {
+	if (connection != nullptr && !xcb_connection_has_error(connection) && pending_completions > 0) {
+		try {
+			wait_for_completion();
+		} catch (const std::exception &e) {
+			log(LOG_WARN, "XShmPresenter: %s\n", e.what());
+		}
+	}
+	if (gc != 0) {
+		xcb_free_gc(connection, gc);
+		gc = 0;
+	}
+	destroy_segment();
+	if (connection != nullptr) {
+		xcb_flush(connection);
+		xcb_disconnect(connection);
+		connection = nullptr;
+	}
+}
+
+void XShmPresenter::create_segment() {
+	size_t stride = framebuffer_stride(width, PIXEL_FORMAT_XRGB8888);
+	size_t size = stride * height;
+	shm_id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shm_id < 0) {
+		throw std::runtime_error("shmget failed");
+	}
+
+	void *addr = shmat(shm_id, nullptr, 0);
+	if (addr == reinterpret_cast<void *>(-1)) {
+		destroy_segment();
+		throw std::runtime_error("shmat failed");
+	}
+	shm_addr = static_cast<uint8_t *>(addr);
+
+	shm_seg = xcb_generate_id(connection);
+	xcb_generic_error_t *error = xcb_request_check(connection, xcb_shm_attach_checked(connection, shm_seg, shm_id, 1));
+	if (error != nullptr) {
+		free(error);
+		shm_seg = 0;
+		destroy_segment();
+		throw std::runtime_error("the X server can't attach our shared memory segment");
+	}
+
+	// Now that both of us are attached, mark the segment for removal so it's
+	// freed even if we crash
+	shmctl(shm_id, IPC_RMID, nullptr);
+
+	// Huge pages only back shared memory if the kernel is set up for it
+	// (shmem_enabled), but prefaulting helps either way
+	prepare_framebuffer_memory(shm_addr, size);
+
+	framebuffer = QImage(shm_addr, width, height, static_cast<qsizetype>(stride), QImage::Format_RGB32);
+}
+
+void XShmPresenter::destroy_segment() {
+	framebuffer = QImage();
+	if (shm_seg != 0) {
+		xcb_shm_detach(connection, shm_seg);
+		shm_seg = 0;
+	}
+	if (shm_addr != nullptr) {
+		shmdt(shm_addr);
+		shm_addr = nullptr;
+	}
+	if (shm_id >= 0) {
+		shmctl(shm_id, IPC_RMID, nullptr);
+		shm_id = -1;
+	}
+}
+
+const char *XShmPresenter::get_name() {
+	return "xshm";
+}
+
+QImage *XShmPresenter::get_framebuffer() {
+	return &framebuffer;
+}
+
+void XShmPresenter::begin_update(const std::shared_ptr<Frame> &frame) {
+	wait_for_completion();
+}
+
+void XShmPresenter::present(const QRegion &region) {
+	put_region(region);
+}
+
+void XShmPresenter::expose(const QRegion &region) {
+	put_region(region);
+}
+
+bool XShmPresenter::paints_on_screen() {
+	return true;
+}
+
+bool XShmPresenter::supports_scroll() {
+	return true;
+}
+
+void XShmPresenter::scroll(const QRect &rect, int dy) {
+	if (framebuffer.isNull()) {
+		return;
+	}
+	int height = rect.height() - abs(dy);
+	if (height <= 0) {
+		return;
+	}
+	// Requests are processed in order, so this moves what earlier puts left
+	// on the window, and the puts that present the new rows come after it
+	int src_y = dy > 0 ? rect.y() + dy : rect.y();
+	int dst_y = dy > 0 ? rect.y() : rect.y() - dy;
+	xcb_copy_area(connection, window, window, gc, rect.x(), src_y, rect.x(), dst_y, rect.width(), height);
+}
+
+void XShmPresenter::suspend() {
+	// The X server may still be reading the segment
+	wait_for_completion();
+	destroy_segment();
+	xcb_flush(connection);
+}
+
+void XShmPresenter::resume() {
+	if (shm_addr != nullptr) {
+		return;
+	}
+	// The segment is fresh, so it's already black
+	create_segment();
+}
+
+void XShmPresenter::put_region(const QRegion &region) {
+	if (framebuffer.isNull()) {
+		return;
+	}
+	QRegion clipped = region.intersected(framebuffer.rect());
+	int count = clipped.rectCount();
+	if (count == 0) {
+		return;
+	}
+	int i = 0;
+	for (const QRect &rect : clipped) {
+		i++;
+		// Requests are processed in order, so we only need a completion
+		// event for the last one. The segment's rows are padded, so its
+		// width is its stride in pixels.
+		xcb_shm_put_image(
+			connection, window, gc,
+			framebuffer.bytesPerLine() / 4, framebuffer.height(),
+			rect.x(), rect.y(), rect.width(), rect.height(),
+			rect.x(), rect.y(),
+			depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+			i == count ? 1 : 0,
+			shm_seg, 0
+		);
+	}
+	pending_completions++;
+	xcb_flush(connection);
+	count_presented(clipped);
+}
+
+void XShmPresenter::wait_for_completion() {
+	while (pending_completions > 0) {
+		xcb_generic_event_t *event = xcb_wait_for_event(connection);
+		if (event == nullptr) {
+			pending_completions = 0;
+			throw std::runtime_error("the X connection of the MIT-SHM presenter was closed");
+		}
+		if ((event->response_type & 0x7f) == completion_event_type) {
+			pending_completions--;
+		} else if (event->response_type == 0) {
+			xcb_generic_error_t *error = reinterpret_cast<xcb_generic_error_t *>(event);
+			log(LOG_WARN, "XShmPresenter: X error %d (request %d.%d)\n", error->error_code, error->major_code, error->minor_code);
+		}
+		free(event);
+	}
+}
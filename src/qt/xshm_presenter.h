@@ -0,0 +1,81 @@
+#ifndef QT_XSHM_PRESENTER_H
+#define QT_XSHM_PRESENTER_H
+
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include "presenter.h"
+
+// Keeps the framebuffer in a MIT-SHM segment shared with the X server we
+// display on, and puts damaged regions directly on the window with
+// XShmPutImage. This skips Qt's backing store, so the pixels are copied once
+// (by the X server, from the shared segment to the screen) instead of twice.
+//
+// The X server reads the segment asynchronously, so we ask for a completion
+// event for every put and don't touch the framebuffer until it arrives.
+// We use our own X connection so our completion events don't go through
+// Qt's event loop.
+class XShmPresenter : public Presenter {
+public:
+	// Throws std::runtime_error if MIT-SHM can't be used (e.g. on remote
+	// displays)
+	XShmPresenter(const char *x11_display, WId window_id, int width, int height);
+	~XShmPresenter();
+
+	const char *get_name() override;
+	QImage *get_framebuffer() override;
+	void begin_update(const std::shared_ptr<Frame> &frame) override;
+	void present(const QRegion &region) override;
+	void expose(const QRegion &region) override;
+	bool paints_on_screen() override;
+
+	// Moves the window's contents with CopyArea, so only the rows scrolled
+	// in are put
+	bool supports_scroll() override;
+	void scroll(const QRect &rect, int dy) override;
+
+	// The segment is freed while suspended, and allocated again on resume
+	void suspend() override;
+	void resume() override;
+
+private:
+	// Allocate the shared memory segment and attach it on both sides
+	// Throws std::runtime_error on failure
+	void create_segment();
+
+	// Detach and free the shared memory segment
+	void destroy_segment();
+
+	// Put a region of the framebuffer on the window
+	void put_region(const QRegion &region);
+
+	// Wait until the X server is done reading the framebuffer
+	void wait_for_completion();
+
+	// Free everything we allocated, used by the destructor and when the
+	// constructor fails halfway
+	void cleanup();
+
+	xcb_connection_t *connection = nullptr;
+	xcb_window_t window;
+	xcb_gcontext_t gc = 0;
+	uint8_t depth = 0;
+	int width;
+	int height;
+
+	// The shared memory segment and its X server side counterpart
+	int shm_id = -1;
+	uint8_t *shm_addr = nullptr;
+	xcb_shm_seg_t shm_seg = 0;
+
+	// The event type of MIT-SHM completion events on our connection
+	uint8_t completion_event_type = 0;
+
+	// Number of puts we haven't got a completion event for yet
+	int pending_completions = 0;
+
+	// Wraps shm_addr, null while we have no segment
+	QImage framebuffer;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+#include "shm_cache.h"
+
+ShmMapping::ShmMapping(void *addr, size_t size, dev_t dev, ino_t ino) {
+	this->addr = addr;
+	this->size = size;
+	this->dev = dev;
+	this->ino = ino;
+}
+
+ShmMapping::~ShmMapping() {
+	munmap(addr, size);
+}
+
+void *ShmMapping::get_addr() {
+	return addr;
+}
+
+size_t ShmMapping::get_size() {
+	return size;
+}
+
+bool ShmMapping::maps(size_t size, dev_t dev, ino_t ino) {
+	return this->size == size && this->dev == dev && this->ino == ino;
+}
+
+ShmMappingCache::ShmMappingCache() :
+	remaps_avoided("capture buffer remaps avoided per frame", "frames", STATS_LOG_EVERY),
+	faults_avoided("capture buffer page faults avoided per frame", "pages", STATS_LOG_EVERY)
+{
+}
+
+bool ShmMappingCache::identify(void *addr, dev_t *dev, ino_t *ino) {
+	// /proc/self/map_files would be simpler, but following its links requires
+	// CAP_SYS_ADMIN, so we look the mapping up in /proc/self/maps instead
+	FILE *maps = fopen("/proc/self/maps", "r");
+	if (maps == nullptr) {
+		log(LOG_WARN, "Failed to open /proc/self/maps, not caching capture buffer mappings: %s\n", strerror(errno));
+		identify_works = false;
+		return false;
+	}
+
+	uintptr_t wanted = reinterpret_cast<uintptr_t>(addr);
+	bool found = false;
+	char line[1024];
+	while (fgets(line, sizeof(line), maps) != nullptr) {
+		uintptr_t start, end;
+		unsigned long long offset;
+		unsigned int major, minor;
+		unsigned long inode;
+		if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %*s %llx %x:%x %lu", &start, &end, &offset, &major, &minor, &inode) != 6) {
+			continue;
+		}
+		if (start < wanted) {
+			continue;
+		}
+		// Mappings are sorted, so we're past it
+		if (start > wanted) {
+			break;
+		}
+		// Anonymous mappings have no identity we can use
+		if (offset != 0 || inode == 0) {
+			break;
+		}
+		*dev = makedev(major, minor);
+		*ino = inode;
+		found = true;
+		break;
+	}
+	fclose(maps);
+	return found;
+}
+
+std::shared_ptr<ShmMapping> ShmMappingCache::adopt(void *addr, size_t size, long touched_pages) {
+	dev_t dev = 0;
+	ino_t ino = 0;
+	if (!identify_works || !identify(addr, &dev, &ino)) {
+		// We can't tell which segment this is, so just use it once
+		remaps_avoided.add(0);
+		return std::make_shared<ShmMapping>(addr, size, 0, 0);
+	}
+
+	if (cached != nullptr && cached->maps(size, dev, ino)) {
+		// libxup's mapping was never touched, so dropping it is cheap
+		munmap(addr, size);
+		remaps_avoided.add(1);
+		faults_avoided.add(touched_pages);
+		return cached;
+	}
+
+	// A new segment (first frame, resize or reconnect), replace the cached
+	// mapping with it
+	if (cached != nullptr) {
+		log(LOG_DEBUG, "Capture buffer changed, replacing the cached mapping\n");
+	}
+	cached = std::make_shared<ShmMapping>(addr, size, dev, ino);
+	remaps_avoided.add(0);
+	return cached;
+}
+
+void ShmMappingCache::invalidate() {
+	cached = nullptr;
+}
@@ -0,0 +1,76 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+// Capture buffer mapping cache
+// libxup maps xorgxrdp's capture buffer for every frame it receives and
+// expects us to unmap it when we're done. The buffer is the same shared memory
+// segment every time (until the screen is resized or we reconnect), so instead
+// of faulting in a fresh mapping of it on every frame, we keep the first
+// mapping around and drop the new ones before they're ever touched.
+
+#include <memory>
+#include <sys/types.h>
+
+#include "stats.h"
+
+// A mapping of a capture buffer, unmapped when the last frame using it is
+// released
+class ShmMapping {
+public:
+	ShmMapping(void *addr, size_t size, dev_t dev, ino_t ino);
+	~ShmMapping();
+
+	ShmMapping(const ShmMapping &) = delete;
+	ShmMapping &operator=(const ShmMapping &) = delete;
+
+	void *get_addr();
+	size_t get_size();
+
+	// Whether this maps the whole of the given segment
+	bool maps(size_t size, dev_t dev, ino_t ino);
+
+private:
+	void *addr;
+	size_t size;
+
+	// Identity of the segment (the memfd's inode)
+	dev_t dev;
+	ino_t ino;
+};
+
+// Keeps the capture buffer mapped across frames
+// This is only used from the xup communicator thread, but the mappings it
+// returns can be released from any thread.
+class ShmMappingCache {
+public:
+	ShmMappingCache();
+
+	// Takes ownership of a mapping made by libxup and returns the mapping to
+	// use for the frame, which is either the cached mapping of the same
+	// segment (in which case the new one is unmapped right away) or the new
+	// mapping itself.
+	// touched_pages is an estimate of how many pages the frame reads, for
+	// the statistics.
+	std::shared_ptr<ShmMapping> adopt(void *addr, size_t size, long touched_pages);
+
+	// Forget the cached mapping, e.g. when the screen is resized
+	// Frames that still use it keep it mapped until they're released.
+	void invalidate();
+
+private:
+	// Find the segment mapped at addr in /proc/self/maps
+	bool identify(void *addr, dev_t *dev, ino_t *ino);
+
+	std::shared_ptr<ShmMapping> cached;
+
+	// Whether identifying segments works at all, so we don't keep trying if
+	// /proc isn't available
+	bool identify_works = true;
+
+	// Counters of frames that reused the cached mapping, and of the page
+	// faults that saved us
+	StatCounter remaps_avoided;
+	StatCounter faults_avoided;
+};
+
+#endif // SHM_CACHE_H
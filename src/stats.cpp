@@ -0,0 +1,36 @@
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+#include "stats.h"
+
+StatCounter::StatCounter(const char *name, const char *unit, int log_every) {
+	this->name = name;
+	this->unit = unit;
+	this->log_every = log_every;
+}
+
+void StatCounter::add(double value) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (count == 0 || value < min) {
+		min = value;
+	}
+	if (count == 0 || value > max) {
+		max = value;
+	}
+	count++;
+	sum += value;
+	sum_squares += value * value;
+
+	if (count < log_every) {
+		return;
+	}
+
+	double avg = sum / count;
+	double stddev = std::sqrt(std::max(0.0, sum_squares / count - avg * avg));
+	log(LOG_DEBUG, "stats: %s: n=%d avg=%.1f min=%.1f max=%.1f stddev=%.1f total=%.0f (%s)\n", name, count, avg, min, max, stddev, sum, unit);
+
+	count = 0;
+	sum = 0;
+	sum_squares = 0;
+}
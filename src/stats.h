@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Performance counters
+
+#include <mutex>
+
+// Default number of samples between summaries, about 5 seconds of frames at
+// 60 fps
+#define STATS_LOG_EVERY 300
+
+// Accumulates samples of a value (pixels copied, time spent, etc.) and
+// periodically logs a summary of them at debug level.
+// Samples can be added from any thread.
+class StatCounter {
+public:
+	// A summary is logged (and the counter is reset) every log_every samples
+	StatCounter(const char *name, const char *unit, int log_every);
+
+	void add(double value);
+
+private:
+	std::mutex mutex;
+
+	const char *name;
+	const char *unit;
+	int log_every;
+
+	int count = 0;
+	double sum = 0;
+	double sum_squares = 0;
+	double min = 0;
+	double max = 0;
+};
+
+#endif // STATS_H
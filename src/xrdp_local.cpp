@@ -7,9 +7,9 @@
 #include "xup.h"
 #include "qt/state.h"
 
-XRDPLocalState::XRDPLocalState(const char *socket_path, int feedback_fd, int max_displays, bool use_dma_buf, bool xrdp_log_debug) {
+XRDPLocalState::XRDPLocalState(const char *socket_path, int feedback_fd, int max_displays, bool use_dma_buf, enum presenter_type presenter_type, enum pixel_format capture_format, bool vblank_pacing, int frames_in_flight, bool xrdp_log_debug) {
 	this->feedback_fd = feedback_fd;
-	qt = new QtState(this, max_displays, use_dma_buf);
+	qt = new QtState(this, max_displays, use_dma_buf, presenter_type, capture_format, vblank_pacing, frames_in_flight);
 	xup = new XRDPModState(this, qt, socket_path, xrdp_log_debug);
 	notify_feedback_fd("connected");
 	qt->launch();
@@ -64,6 +64,24 @@ int main(int argc, char *argv[]) {
 		.default_value(true)
 		.implicit_value(false);
 
+	program.add_argument("--disable-vblank-pacing")
+		.help("acknowledge frames as soon as they're presented instead of at vblank")
+		.default_value(true)
+		.implicit_value(false);
+
+	program.add_argument("--frames-in-flight")
+		.help("set how many frames xorgxrdp may capture ahead of the screen when pacing to vblank (1-3)")
+		.default_value(1)
+		.scan<'i', int>();
+
+	program.add_argument("--presenter")
+		.help("set how frames are put on the screen when not using DMA-BUF (auto, qpainter, xshm, alias, gl)")
+		.default_value(std::string("auto"));
+
+	program.add_argument("--capture-format")
+		.help("set the pixel format xorgxrdp captures the screen in when not using DMA-BUF (a8r8g8b8, r5g6b5)")
+		.default_value(std::string("a8r8g8b8"));
+
 	try {
 		program.parse_args(argc, argv);
 	} catch (const std::runtime_error& err) {
@@ -73,11 +91,33 @@ int main(int argc, char *argv[]) {
 
 	set_log_level(program.get<bool>("-v") ? LOG_DEBUG : LOG_INFO);
 
+	enum presenter_type presenter_type;
+	if (!presenter_type_from_string(program.get<std::string>("--presenter").c_str(), &presenter_type)) {
+		fprintf(stderr, "Invalid presenter: %s\n", program.get<std::string>("--presenter").c_str());
+		return 1;
+	}
+
+	enum pixel_format capture_format;
+	if (!pixel_format_from_string(program.get<std::string>("--capture-format").c_str(), &capture_format)) {
+		fprintf(stderr, "Invalid capture format: %s\n", program.get<std::string>("--capture-format").c_str());
+		return 1;
+	}
+
+	int frames_in_flight = program.get<int>("--frames-in-flight");
+	if (frames_in_flight < 1 || frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+		fprintf(stderr, "Invalid number of frames in flight: %d\n", frames_in_flight);
+		return 1;
+	}
+
 	XRDPLocalState state(
 		program.get<std::string>("socket-path").c_str(),
 		program.get<int>("feedback-fd"),
 		program.get<int>("--max-displays"),
 		program.get<bool>("--disable-dma-buf"),
+		presenter_type,
+		capture_format,
+		program.get<bool>("--disable-vblank-pacing"),
+		frames_in_flight,
 		program.get<bool>("-v")
 	);
 
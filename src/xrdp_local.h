@@ -5,6 +5,7 @@
 
 #include "xup.h"
 #include "qt/state.h"
+#include "qt/presenter.h"
 
 class QtState;
 class XRDPModState;
@@ -40,6 +41,10 @@ public:
 		int feedback_fd,
 		int max_displays,
 		bool use_dma_buf,
+		enum presenter_type presenter_type,
+		enum pixel_format capture_format,
+		bool vblank_pacing,
+		int frames_in_flight,
 		bool xrdp_log_debug
 	);
 	~XRDPLocalState();
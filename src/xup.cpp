@@ -128,6 +128,8 @@ int XRDPModState::client_monitor_resize(struct mod *v, int width, int height,
 
 int XRDPModState::server_monitor_resize_done(struct mod *v) {
 	log(LOG_DEBUG, "Got server_monitor_resize_done.\n");
+	// xorgxrdp allocates a new capture buffer for the new size
+	xrdp_mod_state_from_mod(v)->shm_cache.invalidate();
 	return 0;
 }
 
@@ -281,10 +283,23 @@ int XRDPModState::server_dma_buf_receive_pixmap_fd(struct mod *v,
 							uint32_t size, uint32_t format) {
 	log(LOG_DEBUG, "server_dma_buf_receive_pixmap_fd: %d, %d, %d, %d, %d, %X\n", fd, width, height, stride, size, format);
 
+	// xorgxrdp exports the screen pixmap as a single plane, without telling
+	// its modifier, so the driver's implicit layout is assumed
+	struct dma_buf_image image = {
+		.width = width,
+		.height = height,
+		.format = format,
+		.modifier = DMA_BUF_MOD_INVALID,
+		.num_planes = 1,
+		.planes = { { .fd = fd, .offset = 0, .pitch = stride } },
+	};
+
 	XRDPModState *xrdp_mod_state = xrdp_mod_state_from_mod(v);
-	if (!xrdp_mod_state->qt->enable_dma_buf(fd, width, height, stride, size, format)) {
+	if (!xrdp_mod_state->qt->enable_dma_buf(image)) {
 		log(LOG_ERROR, "Failed to enable DMA buf.\n");
 		v->mod_send_dma_buf_notify(v, DMA_BUF_NOTIFY_INACTIVE);
+		// The framebuffers may have been freed while we tried
+		xrdp_mod_state->request_full_refresh();
 		return 0;
 	}
 
@@ -301,6 +316,9 @@ int XRDPModState::server_dma_buf_deactivate(struct mod *v) {
 	XRDPModState *xrdp_mod_state = xrdp_mod_state_from_mod(v);
 	xrdp_mod_state->qt->disable_dma_buf();
 
+	// The framebuffers were freed while DMA-BUF was active
+	xrdp_mod_state->request_full_refresh();
+
 	log(LOG_INFO, "DMA-BUF disabled.\n");
 
 	return 0;
@@ -309,6 +327,8 @@ int XRDPModState::server_dma_buf_deactivate(struct mod *v) {
 int XRDPModState::server_dma_buf_paint_pixmap(struct mod *v) {
 	log(LOG_DEBUG, "server_dma_buf_paint_pixmap\n");
 	XRDPModState *xrdp_mod_state = xrdp_mod_state_from_mod(v);
+	// The paint message doesn't say what changed, so the whole screen is
+	// redrawn
 	xrdp_mod_state->qt->paint_dma_buf();
 	log(LOG_DEBUG, "server_dma_buf_paint_pixmap done\n");
 	return 0;
@@ -339,11 +359,37 @@ int XRDPModState::server_paint_rects_ex(struct mod *v,
 							void *shmem_ptr, int shmem_bytes) {
 	log(LOG_DEBUG, "server_paint_rects_ex: %d, %d, %d, %d, %d, %d, %d, %d\n", num_drects, num_crects, left, top, width, height, flags, frame_id);
 	XRDPModState *xrdp_mod_state = xrdp_mod_state_from_mod(v);
-	xrdp_mod_state->qt->paint_rects(left, top, reinterpret_cast<unsigned char *>(data), 0, 0, width, height, num_drects, reinterpret_cast<xrdp_rect_spec *>(drects));
-	v->mod_frame_ack(v, flags, frame_id);
+
+	// libxup maps the capture buffer for every frame, swap its mapping for
+	// our cached one so we don't take page faults on it every frame
+	std::shared_ptr<ShmMapping> mapping;
 	if (shmem_ptr != nullptr) {
-		munmap(shmem_ptr, shmem_bytes);
+		long page_size = sysconf(_SC_PAGESIZE);
+		long touched_pages = 0;
+		for (int i = 0; i < num_drects; i++) {
+			// Every row of a rect touches at least one page
+			long row_bytes = static_cast<long>(drects[i * 4 + 2]) * pixel_format_bytes(xrdp_mod_state->qt->get_capture_format());
+			touched_pages += drects[i * 4 + 3] * (row_bytes / page_size + 1);
+		}
+		touched_pages = std::min(touched_pages, (shmem_bytes + page_size - 1) / page_size);
+		mapping = xrdp_mod_state->shm_cache.adopt(shmem_ptr, shmem_bytes, touched_pages);
+		data = static_cast<char *>(mapping->get_addr()) + (data - static_cast<char *>(shmem_ptr));
 	}
+
+	// xorgxrdp doesn't touch the capture buffer until we acknowledge the
+	// frame, so we hand it to the Qt thread and only acknowledge it when the
+	// Qt thread releases it. This keeps the communicator thread free to
+	// forward input in the meantime.
+	auto frame = std::make_shared<Frame>(
+		left, top, width, height,
+		reinterpret_cast<unsigned char *>(data),
+		num_drects, reinterpret_cast<xrdp_rect_spec *>(drects),
+		mapping,
+		[xrdp_mod_state, flags, frame_id]() {
+			xrdp_mod_state->queue_frame_ack(flags, frame_id);
+		}
+	);
+	xrdp_mod_state->qt->paint_frame(std::move(frame));
 	return 0;
 }
 
@@ -467,8 +513,9 @@ void XRDPModState::setup_xup_client_info() {
 	// incompatibility bugs
 	client_info.multimon = 1;
 
-	// Bits per pixel
-	client_info.bpp = 32;
+	// Bits per pixel, xorgxrdp sizes the capture buffer from this
+	enum pixel_format capture_format = qt->get_capture_format();
+	client_info.bpp = pixel_format_bytes(capture_format) * 8;
 
 	// Enable color pointers (xrdp doesn't have a constant for this)
 	client_info.pointer_flags = 1;
@@ -476,8 +523,12 @@ void XRDPModState::setup_xup_client_info() {
 	// This enables server_set_pointer_large, which is untested but should work
 	client_info.large_pointer_support_flags = LARGE_POINTER_FLAG_96x96;
 
-	// This one is the fastest for xorgxrdp, because xorg uses it internally so xorgxrdp just does memcpy
-	client_info.capture_format = XRDP_a8r8g8b8;
+	// a8r8g8b8 is the fastest for xorgxrdp, because xorg uses it internally
+	// so xorgxrdp just does memcpy. r5g6b5 costs xorgxrdp a conversion, but
+	// halves the capture buffer and everything we copy out of it, which is
+	// what's scarce on dense VM hosts.
+	client_info.capture_format = capture_format == PIXEL_FORMAT_RGB565 ? XRDP_r5g6b5 : XRDP_a8r8g8b8;
+	log(LOG_DEBUG, "Capturing in %s\n", pixel_format_name(capture_format));
 
 	client_info.capture_code = CC_SIMPLE;
 
@@ -517,6 +568,16 @@ void XRDPModState::setup_xup_client_info() {
 		client_info.normal_frame_interval = std::min(client_info.normal_frame_interval, static_cast<int>(1000 / display.refresh_rate));
 	}
 
+	// When we acknowledge frames at vblank, that's what paces xorgxrdp, so
+	// make its own timer fast enough to never be the bottleneck. DMA-BUF
+	// paints aren't acknowledged, so its timer is all that paces them, and
+	// a faster one would only paint the pixmap twice per refresh. The
+	// interval can't be changed once connected, so it's left alone whenever
+	// we're going to ask for DMA-BUF.
+	if (qt->is_vblank_paced() && !(dma_buf_supported_in_libxup && qt->may_use_dma_buf())) {
+		client_info.normal_frame_interval = std::max(1, client_info.normal_frame_interval / 2);
+	}
+
 	// Set the client description to the name of the application
 	snprintf(client_info.client_description, sizeof(client_info.client_description), "xrdp_local");
 
@@ -771,7 +832,28 @@ void XRDPModState::enqueue_xrdp_event(int msg, tbus param1, tbus param2, tbus pa
 	xrdp_events.push(event);
 }
 
+void XRDPModState::request_full_refresh() {
+	int width = client_info.display_sizes.session_width;
+	int height = client_info.display_sizes.session_height;
+	enqueue_xrdp_event(WM_INVALIDATE, 0, (width << 16) | height, 0, 0);
+}
+
+void XRDPModState::queue_frame_ack(int flags, int frame_id) {
+	frame_acks_mutex.lock();
+	frame_acks.push_back({ .flags = flags, .frame_id = frame_id });
+	frame_acks_mutex.unlock();
+}
+
 void XRDPModState::process_xrdp_events() {
+	std::vector<xrdp_frame_ack> acks;
+	frame_acks_mutex.lock();
+	acks.swap(frame_acks);
+	frame_acks_mutex.unlock();
+	for (const xrdp_frame_ack &ack : acks) {
+		log(LOG_DEBUG, "Sending frame ack: %d, %d\n", ack.flags, ack.frame_id);
+		xup_mod->mod_frame_ack(xup_mod, ack.flags, ack.frame_id);
+	}
+
 	while (!xrdp_events.empty()) {
 		xrdp_event event = xrdp_events.front();
 		xrdp_events.pop();
@@ -15,8 +15,10 @@ extern "C" {
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #include "qt/state.h"
+#include "shm_cache.h"
 
 // These are private in xrdp, but we need them for the xup client module
 typedef intptr_t tbus;
@@ -35,6 +37,12 @@ struct xrdp_event {
 	tbus param4;
 };
 
+// A frame acknowledgement to be sent to xorgxrdp
+struct xrdp_frame_ack {
+	int flags;
+	int frame_id;
+};
+
 // Wraps around libxup and provides a convenient interface to xorgxrdp
 class XRDPModState {
 	friend XRDPModState *xrdp_mod_state_from_mod(struct mod *mod);
@@ -68,6 +76,18 @@ private:
 
 	int do_request_dma_buf = 0;
 
+	// Frames are released by the Qt thread after they're painted, but libxup
+	// must only be used from the communicator thread, so acknowledgements are
+	// queued here and sent by process_xrdp_events
+	std::mutex frame_acks_mutex;
+	std::vector<xrdp_frame_ack> frame_acks;
+
+	// Queue an acknowledgement for a frame, can be called from any thread
+	void queue_frame_ack(int flags, int frame_id);
+
+	// Keeps xorgxrdp's capture buffer mapped between frames
+	ShmMappingCache shm_cache;
+
 	// Enqueue an xrdp event to be processed by process_xrdp_events
 	void enqueue_xrdp_event(int msg, tbus param1, tbus param2, tbus param3, tbus param4);
 
@@ -283,6 +303,9 @@ public:
 	void key_up(int scan_code);
 
 	void request_dma_buf();
+
+	// Ask xorgxrdp to send us the whole session again
+	void request_full_refresh();
 };
 
 // Helper function to get the XRDPModState from the xup module reference
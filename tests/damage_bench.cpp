@@ -0,0 +1,136 @@
+// Compares DamageRegion's cost model with the two strategies it replaces,
+// over the hand-written rect lists in damage_cases.h:
+// - raw: copy and present xorgxrdp's rects as they are, overlaps included
+// - bounding: copy and present the bounding rect of the damage
+// - model: copy and present the rects DamageRegion picks
+// For each it reports the rects, the pixels copied and presented, and how
+// long picking the rects and copying them into a framebuffer took.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "blit.h"
+#include "damage.h"
+#include "damage_cases.h"
+
+// Each measurement is repeated for at least this long
+#define BENCH_MIN_NS (50 * 1000 * 1000)
+
+struct strategy_result {
+	size_t num_rects;
+	long copied_pixels;
+	long presented_pixels;
+	double pick_us;
+	double copy_us;
+};
+
+static long area_of(const std::vector<blit_rect_spec> &rects) {
+	long area = 0;
+	for (const blit_rect_spec &rect : rects) {
+		area += static_cast<long>(rect.cx) * rect.cy;
+	}
+	return area;
+}
+
+static blit_rect_spec bounding_rect_of(const std::vector<blit_rect_spec> &rects) {
+	if (rects.empty()) {
+		return { .x = 0, .y = 0, .cx = 0, .cy = 0 };
+	}
+	int x1 = rects[0].x;
+	int y1 = rects[0].y;
+	int x2 = rects[0].x + rects[0].cx;
+	int y2 = rects[0].y + rects[0].cy;
+	for (const blit_rect_spec &rect : rects) {
+		x1 = std::min(x1, rect.x);
+		y1 = std::min(y1, rect.y);
+		x2 = std::max(x2, rect.x + rect.cx);
+		y2 = std::max(y2, rect.y + rect.cy);
+	}
+	return { .x = x1, .y = y1, .cx = x2 - x1, .cy = y2 - y1 };
+}
+
+// Run f until BENCH_MIN_NS have passed, returns the average time per run in
+// microseconds
+template <typename F>
+static double time_us(F f) {
+	auto start = std::chrono::steady_clock::now();
+	long runs = 0;
+	long elapsed_ns;
+	do {
+		f();
+		runs++;
+		elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed_ns < BENCH_MIN_NS);
+	return static_cast<double>(elapsed_ns) / runs / 1000.0;
+}
+
+static double time_copy(blit_rect_func blit, std::vector<uint8_t> &dst, const std::vector<uint8_t> &src, size_t stride, const std::vector<blit_rect_spec> &rects) {
+	// Decided for the whole update, like BlitPool does
+	bool non_temporal = area_of(rects) * 4 >= BLIT_NON_TEMPORAL_THRESHOLD;
+	return time_us([&]() {
+		for (const blit_rect_spec &rect : rects) {
+			blit(dst.data(), stride, src.data(), stride, rect.x, rect.y, rect.cx, rect.cy, non_temporal);
+		}
+	});
+}
+
+static void print_result(const char *name, const char *strategy, const strategy_result &result) {
+	printf("%-22s %-9s %6zu rects %9ld copied %9ld presented %9.2f us to pick %9.2f us to copy\n",
+		name, strategy, result.num_rects, result.copied_pixels, result.presented_pixels, result.pick_us, result.copy_us);
+}
+
+int main() {
+	size_t stride = static_cast<size_t>(CANVAS_WIDTH) * 4;
+	std::vector<uint8_t> src(stride * CANVAS_HEIGHT, 0x55);
+	std::vector<uint8_t> dst(stride * CANVAS_HEIGHT, 0);
+	blit_rect_func blit = blit_rect_func_for(PIXEL_FORMAT_XRGB8888, PIXEL_FORMAT_XRGB8888);
+	DamageRegion damage;
+
+	printf("Using the %s blit kernel\n", blit_kernel_name());
+	for (const damage_case &test : damage_cases()) {
+		// Presenting the raw rects goes through a region, so overlaps are
+		// only presented once
+		damage.set(test.rects);
+		long damaged_area = damage.get_area();
+
+		strategy_result raw = {
+			.num_rects = test.rects.size(),
+			.copied_pixels = area_of(test.rects),
+			.presented_pixels = damaged_area,
+			.pick_us = 0,
+			.copy_us = time_copy(blit, dst, src, stride, test.rects),
+		};
+		print_result(test.name, "raw", raw);
+
+		std::vector<blit_rect_spec> bounding;
+		double bounding_pick_us = time_us([&]() {
+			bounding.clear();
+			blit_rect_spec rect = bounding_rect_of(test.rects);
+			if (rect.cx > 0 && rect.cy > 0) {
+				bounding.push_back(rect);
+			}
+		});
+		strategy_result bounding_result = {
+			.num_rects = bounding.size(),
+			.copied_pixels = area_of(bounding),
+			.presented_pixels = area_of(bounding),
+			.pick_us = bounding_pick_us,
+			.copy_us = time_copy(blit, dst, src, stride, bounding),
+		};
+		print_result(test.name, "bounding", bounding_result);
+
+		double model_pick_us = time_us([&]() { damage.set(test.rects); });
+		std::vector<blit_rect_spec> model = damage.get_rects();
+		strategy_result model_result = {
+			.num_rects = model.size(),
+			.copied_pixels = area_of(model),
+			.presented_pixels = area_of(model),
+			.pick_us = model_pick_us,
+			.copy_us = time_copy(blit, dst, src, stride, model),
+		};
+		print_result(test.name, "model", model_result);
+	}
+	return 0;
+}
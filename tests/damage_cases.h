@@ -0,0 +1,97 @@
+#ifndef TESTS_DAMAGE_CASES_H
+#define TESTS_DAMAGE_CASES_H
+
+// Hand-written damage rect lists for damage_test and damage_bench
+// They're synthetic, modeled on the kinds of damage xorgxrdp sends (text
+// drawn glyph by glyph, terminal scrolls, overlapping windows, scattered
+// updates), with a few edge cases.
+
+#include <vector>
+
+#include "damage.h"
+
+// Big enough for every list
+#define CANVAS_WIDTH 1920
+#define CANVAS_HEIGHT 1080
+
+// What DamageRegion should end up with
+enum expected_result {
+	// Don't check, only the invariants matter
+	EXPECT_ANY,
+	// Exactly the damaged pixels, nothing more
+	EXPECT_EXACT,
+	// A single rect, the bounding rect
+	EXPECT_BOUNDING_RECT,
+	// One rect per band, each covering the band's whole extent
+	EXPECT_BAND_EXTENTS,
+};
+
+struct damage_case {
+	const char *name;
+	std::vector<blit_rect_spec> rects;
+	enum expected_result expected;
+	// The number of bands, for EXPECT_BAND_EXTENTS
+	size_t num_bands = 0;
+};
+
+// A line of text drawn glyph by glyph, each glyph touching the next
+static inline std::vector<blit_rect_spec> text_line(int x, int y, int glyphs, int glyph_width, int glyph_height) {
+	std::vector<blit_rect_spec> rects;
+	for (int i = 0; i < glyphs; i++) {
+		rects.push_back({ .x = x + i * glyph_width, .y = y, .cx = glyph_width, .cy = glyph_height });
+	}
+	return rects;
+}
+
+// A scrolling terminal, every line damaged by its own rects that overlap the
+// line above by a row (antialiased descenders)
+static inline std::vector<blit_rect_spec> terminal_scroll(int x, int y, int lines, int width, int line_height) {
+	std::vector<blit_rect_spec> rects;
+	for (int i = 0; i < lines; i++) {
+		rects.push_back({ .x = x, .y = y + i * line_height, .cx = width / 2, .cy = line_height + 1 });
+		rects.push_back({ .x = x + width / 2, .y = y + i * line_height, .cx = width - width / 2, .cy = line_height + 1 });
+	}
+	return rects;
+}
+
+// Small rects scattered over a grid, like a busy desktop with many windows
+// updating at once
+static inline std::vector<blit_rect_spec> scattered(int columns, int rows, int spacing, int size) {
+	std::vector<blit_rect_spec> rects;
+	for (int row = 0; row < rows; row++) {
+		for (int column = 0; column < columns; column++) {
+			rects.push_back({ .x = column * spacing, .y = row * spacing, .cx = size, .cy = size });
+		}
+	}
+	return rects;
+}
+
+static inline std::vector<damage_case> damage_cases() {
+	return {
+		{ "empty", {}, EXPECT_EXACT },
+		{ "cursor blink", { { .x = 412, .y = 300, .cx = 2, .cy = 18 } }, EXPECT_EXACT },
+		{ "duplicate rects", { { .x = 10, .y = 10, .cx = 100, .cy = 20 }, { .x = 10, .y = 10, .cx = 100, .cy = 20 } }, EXPECT_EXACT },
+		{ "text line", text_line(20, 400, 80, 9, 18), EXPECT_EXACT },
+		{ "terminal scroll", terminal_scroll(0, 0, 50, 1280, 20), EXPECT_ANY },
+		{ "opposite corners", { { .x = 0, .y = 0, .cx = 16, .cy = 16 }, { .x = 1900, .y = 1060, .cx = 20, .cy = 20 } }, EXPECT_EXACT },
+		{ "window over window", {
+			{ .x = 100, .y = 100, .cx = 800, .cy = 600 },
+			{ .x = 500, .y = 400, .cx = 800, .cy = 600 },
+			{ .x = 300, .y = 250, .cx = 200, .cy = 100 },
+		}, EXPECT_ANY },
+		{ "L shape", { { .x = 0, .y = 0, .cx = 1000, .cy = 10 }, { .x = 0, .y = 10, .cx = 10, .cy = 1000 } }, EXPECT_EXACT },
+		{ "dense scatter", scattered(40, 30, 11, 10), EXPECT_BOUNDING_RECT },
+		{ "icon grid", scattered(40, 30, 12, 10), EXPECT_BAND_EXTENTS, 30 },
+		{ "sparse scatter", scattered(8, 6, 200, 8), EXPECT_EXACT },
+		{ "ragged glyphs", {
+			{ .x = 50, .y = 52, .cx = 7, .cy = 12 },
+			{ .x = 58, .y = 50, .cx = 8, .cy = 16 },
+			{ .x = 67, .y = 54, .cx = 6, .cy = 10 },
+			{ .x = 74, .y = 50, .cx = 9, .cy = 18 },
+			{ .x = 84, .y = 53, .cx = 7, .cy = 11 },
+		}, EXPECT_BOUNDING_RECT },
+		{ "clipped to the screen", { { .x = 1800, .y = 1000, .cx = 120, .cy = 80 }, { .x = 0, .y = 0, .cx = 1920, .cy = 1 } }, EXPECT_ANY },
+	};
+}
+
+#endif
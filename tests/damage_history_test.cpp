@@ -0,0 +1,92 @@
+// Checks the buffer age damage tracking of the DMA-BUF windows
+// libxup's paint messages don't carry damage yet, so in a session every frame
+// is a full redraw and none of this runs. These cases drive it with the
+// damage and buffer ages a driver with two or three buffers would give.
+
+#include <cstdio>
+#include <vector>
+#include <QRect>
+
+#include "damage_history.h"
+
+static int failed = 0;
+
+static void expect_rect(const char *name, const QRect &got, const QRect &expected) {
+	if (got != expected) {
+		fprintf(stderr, "%s: got %d,%d %dx%d, expected %d,%d %dx%d\n", name,
+			got.x(), got.y(), got.width(), got.height(),
+			expected.x(), expected.y(), expected.width(), expected.height());
+		failed++;
+	}
+}
+
+static void expect_empty(const char *name, const QRect &got) {
+	if (!got.isEmpty()) {
+		fprintf(stderr, "%s: got %d,%d %dx%d, expected nothing\n", name, got.x(), got.y(), got.width(), got.height());
+		failed++;
+	}
+}
+
+static void test_window_damage() {
+	// The second monitor, right of a 1920 wide one
+	QRect geometry(1920, 0, 1280, 1024);
+
+	expect_rect("unknown damage", window_damage(nullptr, geometry), QRect(0, 0, 1280, 1024));
+
+	std::vector<QRect> outside = { QRect(0, 0, 1920, 1080), QRect(3200, 0, 10, 10) };
+	expect_empty("damage on another monitor", window_damage(&outside, geometry));
+
+	std::vector<QRect> straddling = { QRect(1900, 100, 40, 20) };
+	expect_rect("damage across monitors", window_damage(&straddling, geometry), QRect(0, 100, 20, 20));
+
+	std::vector<QRect> several = { QRect(2000, 10, 10, 10), QRect(2100, 500, 20, 30), QRect(10, 10, 10, 10) };
+	expect_rect("several rects", window_damage(&several, geometry), QRect(80, 10, 120, 520));
+}
+
+static void test_buffer_age() {
+	QRect whole(0, 0, 1280, 1024);
+	QRect clock(1200, 0, 80, 20);
+	QRect cursor(600, 500, 2, 18);
+	QRect menu(0, 0, 200, 300);
+	DamageHistory history;
+
+	// Nothing to go on yet
+	expect_rect("first frame", history.add_frame(clock, 2, whole), whole);
+	// Double buffering, the back buffer missed the frame before
+	expect_rect("age 2", history.add_frame(cursor, 2, whole), cursor.united(clock));
+	// The driver gave us the buffer we just drew into again
+	expect_rect("age 1", history.add_frame(clock, 1, whole), clock);
+	// Triple buffering
+	expect_rect("age 3", history.add_frame(menu, 3, whole), menu.united(clock).united(cursor));
+	// The age is unknown (no EGL_EXT_buffer_age, or a new buffer)
+	expect_rect("age 0", history.add_frame(cursor, 0, whole), whole);
+
+	// Only EGL_DAMAGE_HISTORY frames are remembered, which covers a buffer
+	// EGL_DAMAGE_HISTORY + 1 frames old but not one older
+	history.clear();
+	for (int i = 0; i < EGL_DAMAGE_HISTORY + 2; i++) {
+		history.add_frame(QRect(i * 10, 0, 10, 10), 0, whole);
+	}
+	QRect remembered = cursor;
+	for (int i = 2; i < EGL_DAMAGE_HISTORY + 2; i++) {
+		remembered = remembered.united(QRect(i * 10, 0, 10, 10));
+	}
+	expect_rect("oldest remembered buffer", history.add_frame(cursor, EGL_DAMAGE_HISTORY + 1, whole), remembered);
+	expect_rect("buffer too old", history.add_frame(cursor, EGL_DAMAGE_HISTORY + 2, whole), whole);
+
+	// After a rebind nothing from before can be relied on
+	history.clear();
+	expect_rect("after clear", history.add_frame(cursor, 2, whole), whole);
+	expect_rect("after clear, age 2", history.add_frame(clock, 2, whole), clock.united(cursor));
+}
+
+int main() {
+	test_window_damage();
+	test_buffer_age();
+	if (failed != 0) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+// Checks DamageRegion against the hand-written rect lists in damage_cases.h
+// For every list, the rects DamageRegion picks must not overlap, must
+// cover every damaged pixel, must not cover more than the bounding rect, and
+// must cost no more (in DamageRegion's cost model) than the bounding rect.
+// Some lists also check which way the cost model went.
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "damage.h"
+#include "damage_cases.h"
+
+static long rect_cost(const blit_rect_spec &rect) {
+	return static_cast<long>(rect.cx) * rect.cy + DAMAGE_RECT_COST + DAMAGE_ROW_COST * rect.cy;
+}
+
+static bool check_case(DamageRegion &damage, const damage_case &test, std::vector<int> &canvas) {
+	damage.set(test.rects);
+	const std::vector<blit_rect_spec> &rects = damage.get_rects();
+	const blit_rect_spec &bounding_rect = damage.get_bounding_rect();
+	bool ok = true;
+
+	// Mark the damaged pixels with 1, then add 2 for every output rect
+	// covering a pixel, so 3 is damaged and covered once, 2 is an extra
+	// pixel covered once, and anything above 3 is covered twice
+	std::fill(canvas.begin(), canvas.end(), 0);
+	long damaged_area = 0;
+	for (const blit_rect_spec &rect : test.rects) {
+		for (int y = rect.y; y < rect.y + rect.cy; y++) {
+			for (int x = rect.x; x < rect.x + rect.cx; x++) {
+				int &pixel = canvas[static_cast<size_t>(y) * CANVAS_WIDTH + x];
+				if (pixel == 0) {
+					damaged_area++;
+				}
+				pixel = 1;
+			}
+		}
+	}
+
+	long rects_area = 0;
+	long rects_cost = 0;
+	for (const blit_rect_spec &rect : rects) {
+		if (rect.cx <= 0 || rect.cy <= 0) {
+			fprintf(stderr, "%s: empty rect %d,%d %dx%d\n", test.name, rect.x, rect.y, rect.cx, rect.cy);
+			ok = false;
+			continue;
+		}
+		if (rect.x < bounding_rect.x || rect.y < bounding_rect.y ||
+			rect.x + rect.cx > bounding_rect.x + bounding_rect.cx || rect.y + rect.cy > bounding_rect.y + bounding_rect.cy) {
+			fprintf(stderr, "%s: rect %d,%d %dx%d is outside the bounding rect\n", test.name, rect.x, rect.y, rect.cx, rect.cy);
+			ok = false;
+			continue;
+		}
+		rects_area += static_cast<long>(rect.cx) * rect.cy;
+		rects_cost += rect_cost(rect);
+		for (int y = rect.y; y < rect.y + rect.cy; y++) {
+			for (int x = rect.x; x < rect.x + rect.cx; x++) {
+				canvas[static_cast<size_t>(y) * CANVAS_WIDTH + x] += 2;
+			}
+		}
+	}
+
+	long overlapping = 0;
+	long uncovered = 0;
+	for (int pixel : canvas) {
+		if (pixel > 3) {
+			overlapping++;
+		} else if (pixel == 1) {
+			uncovered++;
+		}
+	}
+	if (overlapping != 0) {
+		fprintf(stderr, "%s: %ld pixels are covered by more than one rect\n", test.name, overlapping);
+		ok = false;
+	}
+	if (uncovered != 0) {
+		fprintf(stderr, "%s: %ld damaged pixels aren't covered\n", test.name, uncovered);
+		ok = false;
+	}
+	if (damage.get_area() != damaged_area) {
+		fprintf(stderr, "%s: area is %ld, expected %ld\n", test.name, damage.get_area(), damaged_area);
+		ok = false;
+	}
+
+	long bounding_area = static_cast<long>(bounding_rect.cx) * bounding_rect.cy;
+	if (rects_area > bounding_area) {
+		fprintf(stderr, "%s: the rects cover %ld pixels, more than the bounding rect's %ld\n", test.name, rects_area, bounding_area);
+		ok = false;
+	}
+	if (!rects.empty() && rects_cost > rect_cost(bounding_rect)) {
+		fprintf(stderr, "%s: the rects cost %ld, more than the bounding rect's %ld\n", test.name, rects_cost, rect_cost(bounding_rect));
+		ok = false;
+	}
+
+	switch (test.expected) {
+	case EXPECT_ANY:
+		break;
+	case EXPECT_EXACT:
+		if (rects_area != damaged_area) {
+			fprintf(stderr, "%s: expected exactly the damaged %ld pixels, got %ld\n", test.name, damaged_area, rects_area);
+			ok = false;
+		}
+		break;
+	case EXPECT_BOUNDING_RECT:
+		if (rects.size() != 1 || rects_area != bounding_area) {
+			fprintf(stderr, "%s: expected the bounding rect, got %zu rects covering %ld pixels\n", test.name, rects.size(), rects_area);
+			ok = false;
+		}
+		break;
+	case EXPECT_BAND_EXTENTS:
+		if (rects.size() != test.num_bands) {
+			fprintf(stderr, "%s: expected %zu rects, one per band, got %zu\n", test.name, test.num_bands, rects.size());
+			ok = false;
+		}
+		for (const blit_rect_spec &rect : rects) {
+			if (rect.x != bounding_rect.x || rect.cx != bounding_rect.cx) {
+				fprintf(stderr, "%s: rect %d,%d %dx%d doesn't cover its band's extent\n", test.name, rect.x, rect.y, rect.cx, rect.cy);
+				ok = false;
+			}
+		}
+		break;
+	}
+
+	printf("%s: %zu rects in, %zu rects out, %ld of %ld pixels damaged\n", test.name, test.rects.size(), rects.size(), damaged_area, rects_area);
+	return ok;
+}
+
+int main() {
+	DamageRegion damage;
+	std::vector<int> canvas(static_cast<size_t>(CANVAS_WIDTH) * CANVAS_HEIGHT);
+	int failed = 0;
+	// Reuse the same region, like windows do, so stale state would show up
+	for (const damage_case &test : damage_cases()) {
+		if (!check_case(damage, test, canvas)) {
+			failed++;
+		}
+	}
+	if (failed != 0) {
+		fprintf(stderr, "%d cases failed\n", failed);
+		return 1;
+	}
+	return 0;
+}
@@ -10,6 +10,7 @@ Source0:        %{name}-%{version}.tar.gz
 BuildRequires:  cmake
 BuildRequires:  gcc-c++
 BuildRequires:  qt6-qtbase-devel
+BuildRequires:  libxcb-devel
 BuildRequires:  argparse-devel
 BuildRequires:  xrdp-devel = 1:%{version}
 